@@ -20,18 +20,50 @@ typedef struct LayoutNode {
 	Client *client;
 } LayoutNode;
 
+/* Uniform grid over the tiled rectangles of a monitor, so that point,
+ * nearest and directional lookups only visit the cells around the query. */
+#define GRID_DIM 16
+
+typedef struct {
+	Client *client;
+	struct wlr_box box;
+	unsigned int order; /* position in clients, keeps tie-breaking stable */
+} GridEntry;
+
+struct TileGrid {
+	int valid;
+	struct wlr_box area; /* bounding box of all entries */
+	int cell_w, cell_h;
+	GridEntry *entries;
+	unsigned int nentries, entries_cap;
+	unsigned int cellstart[GRID_DIM * GRID_DIM + 1];
+	unsigned int *items; /* entry indices, grouped per cell */
+	unsigned int items_cap;
+};
+
 static void apply_layout(Monitor *m, LayoutNode *node,
 						struct wlr_box area, unsigned int is_root);
+static void apply_mouse_resize(Monitor *m);
 static void btrtile(Monitor *m);
 static LayoutNode *create_client_node(Client *c);
 static LayoutNode *create_split_node(unsigned int is_split_vertically,
 									LayoutNode *left, LayoutNode *right);
+static void destroy_grid(Monitor *m);
 static void destroy_node(LayoutNode *node);
 static void destroy_tree(Monitor *m);
+static void end_mouse_resize(Monitor *m);
 static LayoutNode *find_client_node(LayoutNode *node, Client *c);
 static LayoutNode *find_suitable_split(LayoutNode *start, unsigned int need_vert);
+static void grid_build(Monitor *m);
+static void grid_cell_range(TileGrid *g, struct wlr_box *box,
+						int *col0, int *row0, int *col1, int *row1);
+static void grid_locate(TileGrid *g, double x, double y, int *col, int *row);
+static Client *grid_neighbour(Monitor *m, Client *sel, unsigned int dir);
+static void init_grid(Monitor *m);
 static void init_tree(Monitor *m);
 static void insert_client(Monitor *m, Client *focused_client, Client *new_client);
+static void invalidate_grid(Monitor *m);
+static void mouse_resize_step(Monitor *m);
 static LayoutNode *remove_client_node(LayoutNode *node, Client *c);
 static void remove_client(Monitor *m, Client *c);
 static void setratio_h(const Arg *arg);
@@ -42,7 +74,7 @@ static Client *xytoclient(double x, double y);
 
 static int resizing_from_mouse = 0;
 static double resize_last_update_x, resize_last_update_y;
-static uint32_t last_resize_time = 0;
+static int resize_motion_pending = 0;
 
 void
 apply_layout(Monitor *m, LayoutNode *node,
@@ -139,14 +171,18 @@ btrtile(Monitor *m)
 	}
 
 	/* If no client is found under cursor, fallback to focustop(m) */
-	if (!(focused = xytoclient(cursor->x, cursor->y)))
+	if (!prelayout_running && !(focused = xytoclient(cursor->x, cursor->y)))
 		focused = focustop(m);
 
-	/* Insert visible clients that are not part of the tree. */
+	/* Insert visible clients that are not part of the tree. Hidden tags
+	 * are only laid out as they are, where clients end up is decided
+	 * when the tag is viewed. */
 	wl_list_for_each(c, &clients, link) {
 		if (VISIBLEON(c, m) && !c->isfloating && !c->isfullscreen && c->mon == m) {
 			found = find_client_node(m->root, c);
 			if (!found) {
+				if (prelayout_running)
+					continue;
 				insert_client(m, focused, c);
 			}
 			n++;
@@ -160,6 +196,53 @@ btrtile(Monitor *m)
 	apply_layout(m, m->root, full_area, 1);
 }
 
+void
+apply_mouse_resize(Monitor *m)
+{
+	if (!resizing_from_mouse || !resize_motion_pending || m != selmon)
+		return;
+
+	/* Keep at most one configure in flight per client, the pointer delta
+	 * keeps accumulating until every tiled client has acked the last one. */
+	if (m->pendingresizes)
+		return;
+
+	mouse_resize_step(m);
+}
+
+void
+end_mouse_resize(Monitor *m)
+{
+	/* The delta gathered since the last step is applied regardless of
+	 * configures in flight, the layout transaction lets the newest win */
+	if (resizing_from_mouse && resize_motion_pending)
+		mouse_resize_step(m);
+	resizing_from_mouse = 0;
+	resize_motion_pending = 0;
+}
+
+void
+mouse_resize_step(Monitor *m)
+{
+	Arg a = {0};
+	double dx_total, dy_total;
+
+	dx_total = cursor->x - resize_last_update_x;
+	dy_total = cursor->y - resize_last_update_y;
+	if (fabs(dx_total) > fabs(dy_total)) {
+		a.f = (float)(dx_total * resize_factor);
+		setratio_h(&a);
+	} else {
+		a.f = (float)(dy_total * resize_factor);
+		setratio_v(&a);
+	}
+	arrange(m);
+
+	resize_motion_pending = 0;
+	resize_last_update_x = cursor->x;
+	resize_last_update_y = cursor->y;
+}
+
 LayoutNode *
 create_client_node(Client *c)
 {
@@ -193,6 +276,17 @@ create_split_node(unsigned int is_split_vertically,
 	return node;
 }
 
+void
+destroy_grid(Monitor *m)
+{
+	if (!m || !m->grid)
+		return;
+	free(m->grid->entries);
+	free(m->grid->items);
+	free(m->grid);
+	m->grid = NULL;
+}
+
 void
 destroy_node(LayoutNode *node)
 {
@@ -245,6 +339,160 @@ find_suitable_split(LayoutNode *start_node, unsigned int need_vertical)
 	return NULL;
 }
 
+void
+grid_build(Monitor *m)
+{
+	TileGrid *g = m->grid;
+	Client *c;
+	GridEntry *e;
+	unsigned int i, order = 0, nitems = 0, len = wl_list_length(&clients);
+	unsigned int fill[GRID_DIM * GRID_DIM];
+	int col, row, col0, row0, col1, row1, x2, y2;
+
+	if (g->entries_cap < len) {
+		free(g->entries);
+		g->entries = ecalloc(len, sizeof(GridEntry));
+		g->entries_cap = len;
+	}
+
+	/* Collect the tiled rectangles currently applied on this monitor. */
+	g->nentries = 0;
+	wl_list_for_each(c, &clients, link) {
+		order++;
+		if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen
+				|| !client_surface(c)->mapped)
+			continue;
+		e = &g->entries[g->nentries++];
+		e->client = c;
+		e->box = c->geom;
+		e->order = order;
+		if (g->nentries == 1) {
+			g->area = c->geom;
+			continue;
+		}
+		x2 = MAX(g->area.x + g->area.width, c->geom.x + c->geom.width);
+		y2 = MAX(g->area.y + g->area.height, c->geom.y + c->geom.height);
+		g->area.x = MIN(g->area.x, c->geom.x);
+		g->area.y = MIN(g->area.y, c->geom.y);
+		g->area.width = x2 - g->area.x;
+		g->area.height = y2 - g->area.y;
+	}
+
+	g->cell_w = MAX(1, (g->area.width + GRID_DIM - 1) / GRID_DIM);
+	g->cell_h = MAX(1, (g->area.height + GRID_DIM - 1) / GRID_DIM);
+
+	/* Count the cells each rectangle covers, then bucket them. */
+	memset(g->cellstart, 0, sizeof(g->cellstart));
+	for (i = 0; i < g->nentries; i++) {
+		grid_cell_range(g, &g->entries[i].box, &col0, &row0, &col1, &row1);
+		for (row = row0; row <= row1; row++)
+			for (col = col0; col <= col1; col++)
+				g->cellstart[row * GRID_DIM + col + 1]++;
+		nitems += (unsigned int)((col1 - col0 + 1) * (row1 - row0 + 1));
+	}
+	for (i = 1; i <= GRID_DIM * GRID_DIM; i++)
+		g->cellstart[i] += g->cellstart[i - 1];
+
+	if (g->items_cap < nitems) {
+		free(g->items);
+		g->items = ecalloc(nitems, sizeof(unsigned int));
+		g->items_cap = nitems;
+	}
+	memcpy(fill, g->cellstart, sizeof(fill));
+	for (i = 0; i < g->nentries; i++) {
+		grid_cell_range(g, &g->entries[i].box, &col0, &row0, &col1, &row1);
+		for (row = row0; row <= row1; row++)
+			for (col = col0; col <= col1; col++)
+				g->items[fill[row * GRID_DIM + col]++] = i;
+	}
+	g->valid = 1;
+}
+
+void
+grid_cell_range(TileGrid *g, struct wlr_box *box,
+		int *col0, int *row0, int *col1, int *row1)
+{
+	/* Edges are inclusive, like the containment test in xytoclient() */
+	grid_locate(g, box->x, box->y, col0, row0);
+	grid_locate(g, box->x + box->width, box->y + box->height, col1, row1);
+}
+
+void
+grid_locate(TileGrid *g, double x, double y, int *col, int *row)
+{
+	*col = (int)floor((x - g->area.x) / g->cell_w);
+	*row = (int)floor((y - g->area.y) / g->cell_h);
+	*col = MAX(0, MIN(GRID_DIM - 1, *col));
+	*row = MAX(0, MIN(GRID_DIM - 1, *row));
+}
+
+Client *
+grid_neighbour(Monitor *m, Client *sel, unsigned int dir)
+{
+	TileGrid *g = m->grid;
+	GridEntry *e, *best = NULL;
+	int r, i, j, col, row, dist, bound, closest_dist = INT_MAX,
+	sel_center_x, sel_center_y, cand_center_x, cand_center_y;
+	unsigned int k;
+
+	if (!g)
+		return NULL;
+	if (!g->valid)
+		grid_build(m);
+
+	sel_center_x = sel->geom.x + sel->geom.width / 2;
+	sel_center_y = sel->geom.y + sel->geom.height / 2;
+	grid_locate(g, sel_center_x, sel_center_y, &col, &row);
+
+	/* Walk rings of cells outwards; a center first seen in ring r is at least
+	 * (r - 1) cells away, so stop once that bound exceeds the best match. */
+	for (r = 0; r < GRID_DIM; r++) {
+		bound = (r - 1) * MIN(g->cell_w, g->cell_h);
+		if (best && closest_dist < bound)
+			break;
+		for (j = row - r; j <= row + r; j++) {
+			if (j < 0 || j >= GRID_DIM)
+				continue;
+			for (i = col - r; i <= col + r;
+					i += (r == 0 || j == row - r || j == row + r) ? 1 : 2 * r) {
+				if (i < 0 || i >= GRID_DIM)
+					continue;
+				for (k = g->cellstart[j * GRID_DIM + i];
+						k < g->cellstart[j * GRID_DIM + i + 1]; k++) {
+					e = &g->entries[g->items[k]];
+					if (e->client == sel)
+						continue;
+
+					/* Check that the candidate lies in the requested direction. */
+					cand_center_x = e->box.x + e->box.width / 2;
+					cand_center_y = e->box.y + e->box.height / 2;
+					if ((dir == 0 && cand_center_x >= sel_center_x)
+							|| (dir == 1 && cand_center_x <= sel_center_x)
+							|| (dir == 2 && cand_center_y >= sel_center_y)
+							|| (dir == 3 && cand_center_y <= sel_center_y)
+							|| dir > 3)
+						continue;
+
+					dist = abs(sel_center_x - cand_center_x) + abs(sel_center_y - cand_center_y);
+					if (dist < closest_dist || (dist == closest_dist && e->order < best->order)) {
+						closest_dist = dist;
+						best = e;
+					}
+				}
+			}
+		}
+	}
+	return best ? best->client : NULL;
+}
+
+void
+init_grid(Monitor *m)
+{
+	if (!m)
+		return;
+	m->grid = ecalloc(1, sizeof(TileGrid));
+}
+
 void
 init_tree(Monitor *m)
 {
@@ -320,6 +568,13 @@ insert_client(Monitor *m, Client *focused_client, Client *new_client)
 	focused_node->split_ratio = 0.5f;
 }
 
+void
+invalidate_grid(Monitor *m)
+{
+	if (m && m->grid)
+		m->grid->valid = 0;
+}
+
 LayoutNode *
 remove_client_node(LayoutNode *node, Client *c)
 {
@@ -402,7 +657,7 @@ setratio_h(const Arg *arg)
 	split_node->split_ratio = new_ratio;
 
 	/* Skip the arrange if done resizing by mouse,
-	 * we call arrange from motionotify */
+	 * we call arrange from apply_mouse_resize */
 	if (!resizing_from_mouse) {
 		arrange(selmon);
 	}
@@ -434,64 +689,22 @@ setratio_v(const Arg *arg)
 	split_node->split_ratio = new_ratio;
 
 	/* Skip the arrange if done resizing by mouse,
-	 * we call arrange from motionotify */
+	 * we call arrange from apply_mouse_resize */
 	if (!resizing_from_mouse) {
 		arrange(selmon);
 	}
 }
 
 void swapclients(const Arg *arg) {
-    Client  *c, *tmp, *target = NULL, *sel = focustop(selmon);
+    Client  *tmp, *target = NULL, *sel = focustop(selmon);
 	LayoutNode *sel_node, *target_node;
-    int closest_dist = INT_MAX, dist, sel_center_x, sel_center_y,
-	cand_center_x, cand_center_y;
 
     if (!sel || sel->isfullscreen ||
         !selmon->root || !selmon->lt[selmon->sellt]->arrange)
         return;
 
-
-    /* Get the center coordinates of the selected client */
-    sel_center_x = sel->geom.x + sel->geom.width / 2;
-    sel_center_y = sel->geom.y + sel->geom.height / 2;
-
-    wl_list_for_each(c, &clients, link) {
-        if (!VISIBLEON(c, selmon) || c->isfloating || c->isfullscreen || c == sel)
-            continue;
-
-        /* Get the center of candidate client */
-        cand_center_x = c->geom.x + c->geom.width / 2;
-        cand_center_y = c->geom.y + c->geom.height / 2;
-
-        /* Check that the candidate lies in the requested direction. */
-        switch (arg->ui) {
-            case 0:
-                if (cand_center_x >= sel_center_x)
-                    continue;
-                break;
-            case 1:
-                if (cand_center_x <= sel_center_x)
-                    continue;
-                break;
-            case 2:
-                if (cand_center_y >= sel_center_y)
-                    continue;
-                break;
-            case 3:
-                if (cand_center_y <= sel_center_y)
-                    continue;
-                break;
-            default:
-                continue;
-        }
-
-        /* Get distance between the centers */
-        dist = abs(sel_center_x - cand_center_x) + abs(sel_center_y - cand_center_y);
-        if (dist < closest_dist) {
-            closest_dist = dist;
-            target = c;
-        }
-    }
+    /* Find the closest tiled client in the requested direction */
+    target = grid_neighbour(selmon, sel, arg->ui);
 
     /* If target is found, swap the two clients’ positions in the layout tree */
     if (target) {
@@ -526,38 +739,70 @@ visible_count(LayoutNode *node, Monitor *m)
 
 Client *
 xytoclient(double x, double y) {
-	Client *c, *closest = NULL;
-	double dist, mindist = INT_MAX, dx, dy;
-
-	wl_list_for_each_reverse(c, &clients, link) {
-		if (VISIBLEON(c, selmon) && !c->isfloating && !c->isfullscreen &&
-			x >= c->geom.x && x <= (c->geom.x + c->geom.width) &&
-			y >= c->geom.y && y <= (c->geom.y + c->geom.height)){
-			return c;
-		}
-	}
+	TileGrid *g;
+	GridEntry *e, *closest = NULL;
+	double dist, mindist = 0, dx, dy, bound;
+	int r, i, j, col, row;
+	unsigned int k, cell;
 
-	/* If no client was found at cursor position fallback to closest. */
-	wl_list_for_each_reverse(c, &clients, link) {
-		if (VISIBLEON(c, selmon) && !c->isfloating && !c->isfullscreen) {
-			dx = 0, dy = 0;
-
-			if (x < c->geom.x)
-				dx = c->geom.x - x;
-			else if (x > (c->geom.x + c->geom.width))
-				dx = x - (c->geom.x + c->geom.width);
-
-			if (y < c->geom.y)
-				dy = c->geom.y - y;
-			else if (y > (c->geom.y + c->geom.height))
-				dy = y - (c->geom.y + c->geom.height);
-
-			dist = sqrt(dx * dx + dy * dy);
-			if (dist < mindist) {
-				mindist = dist;
-				closest = c;
+	if (!selmon || !(g = selmon->grid))
+		return NULL;
+	if (!g->valid)
+		grid_build(selmon);
+	if (!g->nentries)
+		return NULL;
+
+	/* A client containing the point must cover the cell under it. */
+	grid_locate(g, x, y, &col, &row);
+	cell = row * GRID_DIM + col;
+	for (k = g->cellstart[cell]; k < g->cellstart[cell + 1]; k++) {
+		e = &g->entries[g->items[k]];
+		if (x >= e->box.x && x <= (e->box.x + e->box.width) &&
+			y >= e->box.y && y <= (e->box.y + e->box.height) &&
+			(!closest || e->order > closest->order))
+			closest = e;
+	}
+	if (closest)
+		return closest->client;
+
+	/* If no client was found at cursor position fallback to closest,
+	 * searching rings of cells outwards from the cursor. Distances are
+	 * compared squared. */
+	for (r = 0; r < GRID_DIM; r++) {
+		bound = (double)((r - 1) * MIN(g->cell_w, g->cell_h));
+		if (closest && r > 1 && mindist < bound * bound)
+			break;
+		for (j = row - r; j <= row + r; j++) {
+			if (j < 0 || j >= GRID_DIM)
+				continue;
+			for (i = col - r; i <= col + r;
+					i += (r == 0 || j == row - r || j == row + r) ? 1 : 2 * r) {
+				if (i < 0 || i >= GRID_DIM)
+					continue;
+				cell = j * GRID_DIM + i;
+				for (k = g->cellstart[cell]; k < g->cellstart[cell + 1]; k++) {
+					e = &g->entries[g->items[k]];
+					dx = 0, dy = 0;
+
+					if (x < e->box.x)
+						dx = e->box.x - x;
+					else if (x > (e->box.x + e->box.width))
+						dx = x - (e->box.x + e->box.width);
+
+					if (y < e->box.y)
+						dy = e->box.y - y;
+					else if (y > (e->box.y + e->box.height))
+						dy = y - (e->box.y + e->box.height);
+
+					dist = dx * dx + dy * dy;
+					if (!closest || dist < mindist ||
+						(dist == mindist && e->order > closest->order)) {
+						mindist = dist;
+						closest = e;
+					}
+				}
 			}
 		}
 	}
-	return closest;
+	return closest ? closest->client : NULL;
 }
@@ -13,7 +13,16 @@ static const float fullscreen_bg[]         = {0.1f, 0.1f, 0.1f, 1.0f}; /* You ca
 static const char *cursor_theme            = NULL;
 static const char cursor_size[]            = "24"; /* Make sure it's a valid integer, otherwise things will break */
 static const float resize_factor           = 0.0002f; /* Resize multiplier for mouse resizing, depends on mouse sensivity. */
-static const uint32_t resize_interval_ms   = 16; /* Resize interval depends on framerate and screen refresh rate. */
+static const int stall_frames              = 4; /* refresh cycles a client may take to redraw after a resize */
+static const int freeze_timeout            = 300; /* seconds on a hidden tag before a freezehidden client is stopped */
+static const int stopped_interval          = 1000; /* ms between checks whether clients not spawned by dwl are stopped */
+static const int idle_interval             = 500; /* ms, pointer motion is reported to idle clients at most this often */
+static const int dispatch_budget           = 4; /* ms of client requests handled before pending input goes first */
+static const int frame_margin              = 2; /* ms a framedelay monitor rule leaves between composing and vblank */
+static const int cgroups                   = 0; /* put spawned commands in their own cgroup v2 leaf, weighted below */
+static const unsigned int cgroup_weight_focused = 500; /* cpu.weight and io.weight of the focused client */
+static const unsigned int cgroup_weight_visible = 100;
+static const unsigned int cgroup_weight_hidden  = 20;  /* clients on hidden tags */
 static const int showbar                   = 1; /* 0 means no bar */
 static const int topbar                    = 1; /* 0 means bottom bar */
 static const char *fonts[]                 = {"monospace:size=10"};
@@ -44,11 +53,12 @@ static const char *const autostart[] = {
 /* NOTE: ALWAYS keep a rule declared even if you don't use rules (e.g leave at least one example) */
 static const Rule rules[] = {
 
-	/* app_id             title       tags mask     isfloating  skipfocus isterm  noswallow  monitor */
+	/* app_id             title       tags mask     isfloating  skipfocus isterm  noswallow  monitor  unfocusedfps othermonfps freezehidden */
 	/* examples: */
-	{ "Gimp_EXAMPLE",     NULL,       0,            1,          0,         0,      0,         -1 }, /* Start on currently visible tags floating, not tiled */
-	{ "firefox_EXAMPLE",  NULL,       1 << 8,       0,          0,         0,      0,         -1 }, /* Start on ONLY tag "9" */
-	{ "foot",             NULL,       0,            0,          0,         1,      1,         -1 }, /* make foot swallow clients that are not foot */
+	{ "Gimp_EXAMPLE",     NULL,       0,            1,          0,         0,      0,         -1,      0,           0,          0 }, /* Start on currently visible tags floating, not tiled */
+	{ "firefox_EXAMPLE",  NULL,       1 << 8,       0,          0,         0,      0,         -1,      0,           0,          0 }, /* Start on ONLY tag "9" */
+	{ "foot",             NULL,       0,            0,          0,         1,      1,         -1,      0,           0,          0 }, /* make foot swallow clients that are not foot */
+	{ "vesktop_EXAMPLE",  NULL,       0,            0,          0,         0,      0,         -1,      30,          10,         0 }, /* cap frame rate when unfocused or on another monitor */
 };
 
 /* layout(s) */
@@ -67,12 +77,12 @@ static const Layout layouts[] = {
 */
 /* NOTE: ALWAYS add a fallback rule, even if you are completely sure it won't be used */
 static const MonitorRule monrules[] = {
-	/* name       mfact  nmaster scale layout       rotate/reflect                x    y */
+	/* name       mfact  nmaster scale layout       rotate/reflect                x    y    framedelay */
 	/* example of a HiDPI laptop monitor:
-	{ "eDP-1",    0.5f,  1,      2,    &layouts[0], WL_OUTPUT_TRANSFORM_NORMAL,   -1,  -1 },
+	{ "eDP-1",    0.5f,  1,      2,    &layouts[0], WL_OUTPUT_TRANSFORM_NORMAL,   -1,  -1,  0 },
 	*/
 	/* defaults */
-	{ NULL,       0.55f, 1,      1,    &layouts[0], WL_OUTPUT_TRANSFORM_NORMAL,   -1,  -1 },
+	{ NULL,       0.55f, 1,      1,    &layouts[0], WL_OUTPUT_TRANSFORM_NORMAL,   -1,  -1,  0 },
 };
 
 /* keyboard */
@@ -2,14 +2,18 @@
  * See LICENSE file for copyright and license details.
  */
 #include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libinput.h>
 #include <linux/input-event-codes.h>
 #include <math.h>
+#include <poll.h>
 #include <libdrm/drm_fourcc.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -85,13 +89,16 @@
 #define LISTEN(E, L, H)         wl_signal_add((E), ((L)->notify = (H), (L)))
 #define LISTEN_STATIC(E, H)     do { static struct wl_listener _l = {.notify = (H)}; wl_signal_add((E), &_l); } while (0)
 #define TEXTW(mon, text)        (drwl_font_getwidth(mon->drw, text) + mon->lrpad)
+#define HIST_BUCKET             500 /* usec, see histadd() */
+#define PROBE_TIMEOUT           1000000 /* usec, see latencyinput() */
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeUrg }; /* color schemes */
 enum { CurNormal, CurPressed, CurMove, CurResize }; /* cursor */
 enum { XDGShell, LayerShell, X11 }; /* client types */
 enum { LyrBg, LyrBottom, LyrTile, LyrFloat, LyrTop, LyrFS, LyrOverlay, LyrBlock, NUM_LAYERS }; /* scene layers */
-enum { ClkTagBar, ClkLtSymbol, ClkStatus, ClkTitle, ClkClient, ClkRoot }; /* clicks */
+enum { ClkTagBar, ClkLtSymbol, ClkStatus, ClkTitle, ClkClient, ClkRoot, NUM_CLICKS }; /* clicks */
+enum { VisUnknown, VisHidden, VisOccluded, VisPartial, VisVisible }; /* client visibility */
 #ifdef XWAYLAND
 enum { NetWMWindowTypeDialog, NetWMWindowTypeSplash, NetWMWindowTypeToolbar,
 	NetWMWindowTypeUtility, NetLast }; /* EWMH atoms */
@@ -112,8 +119,20 @@ typedef struct {
 	const Arg arg;
 } Button;
 
+typedef struct {
+	int end; /* right edge in bar buffer pixels, exclusive */
+	unsigned int click;
+	uint32_t tags; /* ClkTagBar only */
+} BarRegion;
+
+typedef struct {
+	uint32_t count[256]; /* HIST_BUCKET wide, the last one is open-ended */
+	uint32_t samples;
+} Histogram;
+
 typedef struct Pertag Pertag;
 typedef struct LayoutNode LayoutNode;
+typedef struct TileGrid TileGrid;
 typedef struct Monitor Monitor;
 typedef struct Client Client;
 struct Client {
@@ -124,7 +143,10 @@ struct Client {
 	Monitor *mon;
 	struct wlr_scene_tree *scene;
 	struct wlr_scene_rect *border[4]; /* top, bottom, left, right */
+	int solidborder; /* border[0] alone, behind the surface, see updateborder() */
 	struct wlr_scene_tree *scene_surface;
+	struct wlr_box clip; /* last set on scene_surface, see resizescene() */
+	struct wlr_scene_tree *snapshot; /* old contents shown during a layout change */
 	struct wl_list link;
 	struct wl_list flink;
 	union {
@@ -152,14 +174,32 @@ struct Client {
 #endif
 	unsigned int bw;
 	uint32_t tags;
+	int layer; /* scene layer, see setlayer() */
 	int isfloating,
       isurgent,
       isfullscreen,
       skipfocus,
       isterm,
       noswallow,
-      was_tiled;
+      was_tiled,
+      occluded, /* stacked out of sight by the layout */
+      covered, /* hidden behind opaque clients, see updateocclusion() */
+      overlapped, /* partly behind opaque clients */
+      translucent; /* alpha multiplier below 1, hides nothing behind it */
+	int visibility; /* see updatevisibility() */
+	uint32_t outputs; /* Monitor.bit of the outputs it is rendered on */
 	uint32_t resize; /* configure serial of a pending resize */
+	int64_t resize_sent, resize_deadline; /* msec, see resizeapply() */
+	int isslow; /* missed the deadline of its pending resize */
+	int scenepending; /* new geometry waits for commitlayout() */
+	Monitor *resizemon; /* counts its pending resize, see updatepending() */
+	int unfocusedfps, othermonfps; /* frame done rate caps, 0 means none */
+	int64_t lastframe; /* msec, when frame done was last sent */
+	int freezehidden, frozen; /* SIGSTOP while on a hidden tag, see freezeclients() */
+	int64_t hidden_since; /* msec, 0 while visible */
+	int ischild, stopped; /* spawned by dwl, process stopped, see setstopped() */
+	pid_t scope; /* cgroup leaf app-<scope> the client runs in, see cgroupenter() */
+	unsigned int cgweight; /* weight last written for its scope */
 	pid_t pid;
 	Client *swallowing, *swallowedby;
 	struct wlr_box old_geom;
@@ -186,8 +226,15 @@ typedef struct {
 	uint32_t mods; /* invalid if keycode == 0 */
 	struct wl_event_source *key_repeat_source;
 
+	/* keys[] ordered by keycode in this group's keymap, the bindings of
+	 * keycode k are bindings[bindstart[k]] up to bindings[bindstart[k + 1]] */
+	const Key **bindings;
+	uint32_t *bindstart;
+	xkb_keycode_t maxbinding;
+
 	struct wl_listener modifiers;
 	struct wl_listener key;
+	struct wl_listener keymap;
 	struct wl_listener destroy;
 } KeyboardGroup;
 
@@ -208,6 +255,15 @@ typedef struct {
 	struct wl_listener surface_commit;
 } LayerSurface;
 
+typedef struct {
+	struct wlr_xdg_popup *popup;
+	struct wlr_box geom; /* last committed, see commitpopup() */
+	int mapped;
+
+	struct wl_listener commit;
+	struct wl_listener destroy;
+} Popup;
+
 typedef struct {
 	const char *symbol;
 	void (*arrange)(Monitor *);
@@ -229,6 +285,7 @@ struct Monitor {
 	struct wlr_scene_buffer *scene_buffer; /* bar buffer */
 	struct wlr_scene_rect *fullscreen_bg; /* See createmon() for info */
 	struct wl_listener frame;
+	struct wl_listener present;
 	struct wl_listener destroy;
 	struct wl_listener request_state;
 	struct wl_listener destroy_lock_surface;
@@ -251,10 +308,40 @@ struct Monitor {
 	int nmaster;
 	char ltsymbol[16];
 	int asleep;
+	uint32_t bit; /* identifies the monitor in Client.outputs */
+	struct timespec frame_time; /* when the last frame was rendered */
+	int layout_txn; /* clients are still catching up with a new layout */
+	int arranging; /* in arrange(), tiled clients wait for commitlayout() */
+	int layout_txn_late; /* layout_txn_timer fired, look for late clients */
+	int pendingresizes; /* tiled clients shown here with a configure in flight */
+	struct wl_event_source *layout_txn_timer;
+	struct wl_event_source *prelayout_idle;
 	LayoutNode *root;
+	TileGrid *grid;
 	Drwl *drw;
 	Buffer *pool[2];
 	int lrpad;
+	BarRegion *regions; /* left to right, filled in by drawbar() */
+	int nregions;
+	Histogram latency; /* input to presentation, see latencyinput() */
+	int framedelay; /* from the monitor rule */
+	int framedelayed; /* frame_timer is armed */
+	int framemisses, framebackoff; /* see presentmon() */
+	int64_t last_vblank, frame_deadline; /* usec */
+	int64_t frame_target; /* usec, frame_deadline of the commit frame_seq */
+	uint32_t frame_seq;
+	struct {
+		int interval[128]; /* usec between back to back presentations */
+		int compose[128]; /* usec commitframe() took */
+		unsigned int presents, frames; /* entries written to each */
+		unsigned int skipped; /* frames shown with the layout held back */
+		unsigned int failed; /* commits the output refused */
+		unsigned int missed; /* presented a refresh cycle or more late */
+		int64_t committed; /* usec, last commit of new content */
+	} stats;
+	struct wl_event_source *frame_timer;
+	struct wl_event_source *fps_timer; /* frame for clients held back by a rate cap */
+	int64_t fps_due; /* msec fps_timer is armed for, 0 if it is not */
 };
 
 typedef struct {
@@ -265,6 +352,7 @@ typedef struct {
 	const Layout *lt;
 	enum wl_output_transform rr;
 	int x, y;
+	int framedelay; /* commit just before vblank, see rendermon() */
 } MonitorRule;
 
 typedef struct {
@@ -281,6 +369,9 @@ typedef struct {
 	int isterm;
 	int noswallow;
 	int monitor;
+	int unfocusedfps;
+	int othermonfps;
+	int freezehidden;
 } Rule;
 
 typedef struct {
@@ -292,6 +383,23 @@ typedef struct {
 	struct wl_listener destroy;
 } SessionLock;
 
+typedef struct {
+	char appid[64];
+	unsigned int stalls;
+	int64_t worst, total; /* msec */
+} StallStats;
+
+typedef struct {
+	struct wlr_scene_node *node; /* NULL while empty */
+	struct wlr_box box; /* layout area in which node stays the one hit */
+	double x, y; /* layout position of the surface origin */
+	int lx, ly; /* layout position of node when it was cached */
+	struct wlr_surface *surface;
+	Client *c;
+	LayerSurface *l;
+	struct wl_listener destroy;
+} HitCache;
+
 /* function declarations */
 static void applybounds(Client *c, struct wlr_box *bbox);
 static void applyrules(Client *c);
@@ -299,8 +407,13 @@ static void arrange(Monitor *m);
 static void arrangelayer(Monitor *m, struct wl_list *list,
 		struct wlr_box *usable_area, int exclusive);
 static void arrangelayers(Monitor *m);
+static void arrangelayout(Monitor *m);
 static void autostartexec(void);
 static void axisnotify(struct wl_listener *listener, void *data);
+static unsigned int barclick(Monitor *m, double x, uint32_t *mask);
+static void bindbuttons(void);
+static xkb_keycode_t bindkeycode(struct xkb_keymap *keymap, xkb_keycode_t keycode);
+static void bindkeys(KeyboardGroup *group);
 static void btrtile(Monitor *m);
 static bool baracceptsinput(struct wlr_scene_buffer *buffer, double *sx, double *sy);
 static void bufdestroy(struct wlr_buffer *buffer);
@@ -310,12 +423,26 @@ static void bufdataend(struct wlr_buffer *buffer);
 static Buffer *bufmon(Monitor *m);
 static void bufrelease(struct wl_listener *listener, void *data);
 static void buttonpress(struct wl_listener *listener, void *data);
+static void cachehit(struct wlr_scene_node *node, int layer, double x, double y,
+		double sx, double sy);
+static void cgroupenter(void);
+static void cgroupinit(void);
+static pid_t cgroupscope(pid_t pid);
+static void cgroupsweep(void);
+static void cgroupwrite(pid_t scope, const char *file, const char *fmt, unsigned int value);
+static void childnotify(void);
 static void chvt(const Arg *arg);
+static void checkconstraint(void);
 static void checkidleinhibitor(struct wlr_surface *exclude);
 static void cleanup(void);
 static void cleanupmon(struct wl_listener *listener, void *data);
+static void cliphit(struct wlr_scene_node *node, int lx, int ly, double x, double y,
+		int *above);
 static void closemon(Monitor *m);
+static void commitframe(Monitor *m);
+static void commithit(struct wlr_surface *surface);
 static void commitlayersurfacenotify(struct wl_listener *listener, void *data);
+static void commitlayout(Monitor *m);
 static void commitnotify(struct wl_listener *listener, void *data);
 static void commitpopup(struct wl_listener *listener, void *data);
 static void createdecoration(struct wl_listener *listener, void *data);
@@ -332,6 +459,7 @@ static void createpopup(struct wl_listener *listener, void *data);
 static void cursorconstrain(struct wlr_pointer_constraint_v1 *constraint);
 static void cursorframe(struct wl_listener *listener, void *data);
 static void cursorwarptohint(void);
+static int delayedframe(void *data);
 static void destroydecoration(struct wl_listener *listener, void *data);
 static void destroydragicon(struct wl_listener *listener, void *data);
 static void destroyidleinhibitor(struct wl_listener *listener, void *data);
@@ -340,15 +468,19 @@ static void destroylock(SessionLock *lock, int unlocked);
 static void destroylocksurface(struct wl_listener *listener, void *data);
 static void destroynotify(struct wl_listener *listener, void *data);
 static void destroypointerconstraint(struct wl_listener *listener, void *data);
+static void destroypopup(struct wl_listener *listener, void *data);
 static void destroysessionlock(struct wl_listener *listener, void *data);
 static void destroysessionmgr(struct wl_listener *listener, void *data);
 static void destroykeyboardgroup(struct wl_listener *listener, void *data);
 static Monitor *dirtomon(enum wlr_direction dir);
+static void dumpstats(void);
 static void dwl_ipc_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 static void dwl_ipc_manager_destroy(struct wl_resource *resource);
 static void dwl_ipc_manager_get_output(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *output);
 static void dwl_ipc_manager_release(struct wl_client *client, struct wl_resource *resource);
 static void dwl_ipc_output_destroy(struct wl_resource *resource);
+static void dwl_ipc_output_get_frame_stats(struct wl_client *client, struct wl_resource *resource);
+static void dwl_ipc_output_get_latency(struct wl_client *client, struct wl_resource *resource);
 static void dwl_ipc_output_printstatus(Monitor *monitor);
 static void dwl_ipc_output_printstatus_to(DwlIpcOutput *ipc_output);
 static void dwl_ipc_output_set_client_tags(struct wl_client *client, struct wl_resource *resource, uint32_t and_tags, uint32_t xor_tags);
@@ -361,60 +493,100 @@ static void focusclient(Client *c, int lift);
 static void focusmon(const Arg *arg);
 static void focusstack(const Arg *arg);
 static Client *focustop(Monitor *m);
+static int fpstimeout(void *data);
+static void freezeclient(Client *c, int freeze);
+static int freezeclients(void *data);
+static void freezevisibility(struct wl_listener *listener, void *data);
 static void fullscreennotify(struct wl_listener *listener, void *data);
 static void gpureset(struct wl_listener *listener, void *data);
 static void handlecursoractivity(void);
 static int hidecursor(void *data);
 static void handlesig(int signo);
+static void histadd(Histogram *h, int64_t usec);
+static uint32_t histpercentile(const Histogram *h, unsigned int pct);
+static void hitdestroy(struct wl_listener *listener, void *data);
+static void idleactivity(void);
+static void idlevisibility(struct wl_listener *listener, void *data);
 static void incnmaster(const Arg *arg);
 static void inputdevice(struct wl_listener *listener, void *data);
-static int keybinding(uint32_t mods, xkb_keycode_t keycode);
+static void invalidatehit(void);
+static void joinlayout(Client *c);
+static int keybinding(KeyboardGroup *group, uint32_t mods, xkb_keycode_t keycode);
+static void keymapnotify(struct wl_listener *listener, void *data);
 static void keypress(struct wl_listener *listener, void *data);
 static void keypressmod(struct wl_listener *listener, void *data);
 static int keyrepeat(void *data);
 static void killclient(const Arg *arg);
+static void latencycommit(struct wlr_surface *surface);
+static void latencyinput(struct wlr_surface *surface);
+static int layouttimeout(void *data);
 static void locksession(struct wl_listener *listener, void *data);
 static void mapnotify(struct wl_listener *listener, void *data);
 static void maximizenotify(struct wl_listener *listener, void *data);
 static void monocle(Monitor *m);
+static int64_t monotonicmsec(void);
+static int64_t monotonicusec(void);
 static void motionabsolute(struct wl_listener *listener, void *data);
 static void motionnotify(uint32_t time, struct wlr_input_device *device, double sx,
 		double sy, double sx_unaccel, double sy_unaccel);
 static void motionrelative(struct wl_listener *listener, void *data);
 static void moveresize(const Arg *arg);
+static void occludeclient(Client *c, pixman_region32_t *covered);
 static void outputmgrapply(struct wl_listener *listener, void *data);
 static void outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test);
 static void outputmgrtest(struct wl_listener *listener, void *data);
 static void pointerfocus(Client *c, struct wlr_surface *surface,
 		double sx, double sy, uint32_t time);
+static void pointermotion(uint32_t time);
+static int pollstopped(void *data);
+static int predictgeom(Client *c, struct wlr_box *geom);
+static void prelayout(void *data);
+static void presentmon(struct wl_listener *listener, void *data);
 static void printstatus(void);
 static void powermgrsetmode(struct wl_listener *listener, void *data);
+static int procstopped(pid_t pid);
 static void quit(const Arg *arg);
+static void raiseclient(Client *c);
 static void rendermon(struct wl_listener *listener, void *data);
 static void requestdecorationmode(struct wl_listener *listener, void *data);
 static void requeststartdrag(struct wl_listener *listener, void *data);
 static void requestmonstate(struct wl_listener *listener, void *data);
 static void resizeapply(Client *c, struct wlr_box geo, int interact);
+static void resizedeadline(Client *c);
 static void resizenoapply(Client *c, struct wlr_box geo, int interact);
+static void resizeprelayout(Client *c, struct wlr_box geo, int interact);
+static void resizescene(Client *c);
+static void resizevisibility(struct wl_listener *listener, void *data);
+static int ringpercentile(const int *ring, unsigned int n, unsigned int pct);
 static void run(char *startup_cmd);
+static void runloop(void);
+static void sendframedone(struct wlr_scene_buffer *buffer, int sx, int sy, void *data);
 static void setcursor(struct wl_listener *listener, void *data);
 static void setcursorshape(struct wl_listener *listener, void *data);
 static void setfloating(Client *c, int floating);
 static void setfullscreen(Client *c, int fullscreen);
 static void setgamma(struct wl_listener *listener, void *data);
+static void setlayer(Client *c, int layer);
 static void setlayout(const Arg *arg);
 static void setmfact(const Arg *arg);
 static void setmon(Client *c, Monitor *m, uint32_t newtags);
 static void setpsel(struct wl_listener *listener, void *data);
 static void setsel(struct wl_listener *listener, void *data);
+static void setstopped(Client *c, int stopped);
 static void setup(void);
+static int signalnotify(int fd, uint32_t mask, void *data);
+static void snapshotbuffer(struct wlr_scene_buffer *buffer, int sx, int sy, void *data);
+static int solidborder(Client *c);
 static void setratio_h(const Arg *arg);
 static void setratio_v(const Arg *arg);
 static void swapclients(const Arg *arg);
 static void spawn(const Arg *arg);
+static void stallbegin(Client *c);
+static void stallend(Client *c);
 static void startdrag(struct wl_listener *listener, void *data);
 static int statusin(int fd, unsigned int mask, void *data);
 static void tag(const Arg *arg);
+static unsigned int tagindex(uint32_t mask);
 static void tagmon(const Arg *arg);
 static void tile(Monitor *m);
 static void togglebar(const Arg *arg);
@@ -425,9 +597,14 @@ static void toggleview(const Arg *arg);
 static void unlocksession(struct wl_listener *listener, void *data);
 static void unmaplayersurfacenotify(struct wl_listener *listener, void *data);
 static void unmapnotify(struct wl_listener *listener, void *data);
-static void updatemons(struct wl_listener *listener, void *data);
 static void updatebar(Monitor *m);
+static void updateborder(Client *c);
+static void updatemons(struct wl_listener *listener, void *data);
+static void updateocclusion(void);
+static void updatepending(Client *c);
 static void updatetitle(struct wl_listener *listener, void *data);
+static void updatevisibility(Client *c);
+static void updateweights(void);
 static void urgent(struct wl_listener *listener, void *data);
 static void view(const Arg *arg);
 static void virtualkeyboard(struct wl_listener *listener, void *data);
@@ -449,6 +626,22 @@ static int locked;
 static void *exclusive_focus;
 static struct wl_display *dpy;
 static struct wl_event_loop *event_loop;
+static struct wl_event_loop *input_loop; /* backend and input devices, see runloop() */
+static volatile sig_atomic_t running;
+static struct {
+	unsigned int turns;
+	unsigned int preempted; /* client dispatch cut short by pending input */
+	unsigned int exhausted; /* client dispatch ran out of dispatch_budget */
+	int64_t latency_max, latency_total; /* usec input waited behind clients */
+} loop_stats;
+/* One input event at a time is followed to the screen */
+static struct {
+	int64_t input; /* usec, 0 while nothing is followed */
+	struct wlr_surface *surface; /* the toplevel or layer surface it went to */
+	Monitor *mon;
+	int committed; /* surface committed after output commit seq */
+	uint32_t seq;
+} latency_probe;
 static struct wlr_backend *backend;
 static struct wlr_scene *scene;
 static struct wlr_scene_tree *layers[NUM_LAYERS];
@@ -483,6 +676,11 @@ static struct wlr_cursor *cursor;
 static struct wlr_xcursor_manager *cursor_mgr;
 static struct wl_event_source *hide_source;
 static bool cursor_hidden = false;
+static int hide_armed;
+static int64_t cursor_activity; /* msec, see hidecursor() */
+static int64_t idle_notified; /* msec, see idleactivity() */
+static int cursor_default; /* the "default" xcursor is shown */
+static struct wlr_surface *constraint_surface; /* pointer focus last checked for a constraint */
 static struct {
 	enum wp_cursor_shape_device_v1_shape shape;
 	struct wlr_surface *surface;
@@ -496,9 +694,18 @@ static struct wlr_scene_rect *locked_bg;
 static struct wlr_session_lock_v1 *cur_lock;
 static struct wl_listener lock_listener = {.notify = locksession};
 
+/* Emitted with the Client whenever its visibility or outputs change */
+static struct wl_signal visibility_signal;
+static struct wl_listener idle_visibility = {.notify = idlevisibility};
+static struct wl_listener freeze_visibility = {.notify = freezevisibility};
+static struct wl_listener resize_visibility = {.notify = resizevisibility};
+
 static struct wlr_seat *seat;
 static KeyboardGroup *kb_group;
+static struct xkb_keymap *keys_keymap; /* the keymap keycodes in keys[] refer to */
 static unsigned int cursor_mode;
+static int motion_pending; /* pointer moved since the last input frame */
+static uint32_t motion_time; /* of the latest pending motion */
 static Client *grabc;
 static int grabcx, grabcy; /* client-relative */
 
@@ -508,10 +715,23 @@ static struct wl_list mons;
 static Monitor *selmon;
 
 static struct zdwl_ipc_manager_v2_interface dwl_manager_implementation = {.release = dwl_ipc_manager_release, .get_output = dwl_ipc_manager_get_output};
-static struct zdwl_ipc_output_v2_interface dwl_output_implementation = {.release = dwl_ipc_output_release, .set_tags = dwl_ipc_output_set_tags, .set_layout = dwl_ipc_output_set_layout, .set_client_tags = dwl_ipc_output_set_client_tags};
+static struct zdwl_ipc_output_v2_interface dwl_output_implementation = {.release = dwl_ipc_output_release, .set_tags = dwl_ipc_output_set_tags, .set_layout = dwl_ipc_output_set_layout, .set_client_tags = dwl_ipc_output_set_client_tags, .get_latency = dwl_ipc_output_get_latency, .get_frame_stats = dwl_ipc_output_get_frame_stats};
 static void (*resize)(Client *c, struct wlr_box geo, int interact) = resizeapply;
 static char stext[256];
 static struct wl_event_source *status_event_source;
+static char cgroup_path[PATH_MAX]; /* dwl's cgroup, empty when not managing cgroups */
+static struct wl_event_source *freeze_source;
+static int freeze_armed;
+static int sig_pipe[2] = {-1, -1}; /* handlesig() passes signals on to signalnotify() */
+static struct wl_event_source *stopped_source;
+static int stopped_armed;
+static int occlusion_dirty; /* stacking or opaque areas changed */
+static const int clientlayers[] = {LyrTile, LyrFloat, LyrFS}; /* have tag subtrees */
+static uint32_t prelayout_running; /* hidden tag being laid out, see prelayout() */
+static uint32_t prelayout_hidden; /* all hidden tags prelayout() lays out */
+static unsigned int stall_count;
+static StallStats stall_worst[8]; /* worst offenders by app_id */
+static HitCache hitcache; /* last xytonode() result, see cachehit() */
 
 static const struct wlr_buffer_impl buffer_impl = {
     .destroy = bufdestroy,
@@ -544,9 +764,14 @@ struct Pertag {
 	float mfacts[TAGCOUNT + 1]; /* mfacts per tag */
 	unsigned int sellts[TAGCOUNT + 1]; /* selected layouts */
 	const Layout *ltidxs[TAGCOUNT + 1][2]; /* matrix of tags and layouts indexes  */
+	struct wlr_scene_tree *trees[NUM_LAYERS][TAGCOUNT + 1]; /* clients by layer and tag */
 };
 static pid_t *autostart_pids;
 static size_t autostart_len;
+/* buttons[] ordered by click, the buttons of click c are
+ * clickbuttons[clickstart[c]] up to clickbuttons[clickstart[c + 1]] */
+static const Button *clickbuttons[LENGTH(buttons)];
+static unsigned int clickstart[NUM_CLICKS + 1];
 
 /* function implementations */
 void
@@ -575,6 +800,7 @@ applyrules(Client *c)
 	int i;
 	const Rule *r;
 	Monitor *mon = selmon, *m;
+	siginfo_t in = {0};
 
 	c->isfloating = client_is_float_type(c);
 	if (!(appid = client_get_appid(c)))
@@ -583,6 +809,18 @@ applyrules(Client *c)
 		title = broken;
 
 	c->pid = client_get_pid(c);
+	c->scope = cgroupscope(c->pid);
+	/* Our children report stop and continue through SIGCHLD, the state of
+	 * other processes is read periodically, see pollstopped() */
+	if (c->pid > 0 && !client_is_x11(c)) {
+		c->ischild = !waitid(P_PID, c->pid, &in,
+				WEXITED|WSTOPPED|WCONTINUED|WNOHANG|WNOWAIT);
+		c->stopped = procstopped(c->pid);
+		if (!c->ischild && !stopped_armed) {
+			stopped_armed = 1;
+			wl_event_source_timer_update(stopped_source, stopped_interval);
+		}
+	}
 
 	for (r = rules; r < END(rules); r++) {
 		if ((!r->title || strstr(title, r->title))
@@ -591,6 +829,9 @@ applyrules(Client *c)
 			c->skipfocus = r->skipfocus;
 			c->isterm     = r->isterm;
 			c->noswallow  = r->noswallow;
+			c->unfocusedfps = r->unfocusedfps;
+			c->othermonfps = r->othermonfps;
+			c->freezehidden = r->freezehidden;
 			newtags |= r->tags;
 			i = 0;
 			wl_list_for_each(m, &mons, link) {
@@ -650,60 +891,80 @@ void
 arrange(Monitor *m)
 {
 	Client *c;
+	size_t i, l;
+
+	/* The btrtile lookup grid may still hold another tagset */
+	invalidate_grid(m);
+	invalidatehit();
 
 	if (!m->wlr_output->enabled)
 		return;
 
+	/* The layout decides again which clients it keeps out of sight */
 	wl_list_for_each(c, &clients, link) {
 		if (c->mon == m) {
-			wlr_scene_node_set_enabled(&c->scene->node, VISIBLEON(c, m));
-			client_set_suspended(c, !VISIBLEON(c, m));
+			/* Let it run again before it is configured for its tag */
+			if (VISIBLEON(c, m) && c->frozen)
+				freezeclient(c, 0);
+			/* The subtree of a single tag is shown or hidden as a whole */
+			wlr_scene_node_set_enabled(&c->scene->node,
+					(tagindex(c->tags) < TAGCOUNT || VISIBLEON(c, m))
+					&& !c->occluded && !c->covered);
+			client_set_suspended(c, !VISIBLEON(c, m) || c->occluded || c->covered);
+			c->occluded = 0;
 		}
 	}
 
+	for (l = 0; l < LENGTH(clientlayers); l++) {
+		for (i = 0; i < TAGCOUNT; i++)
+			wlr_scene_node_set_enabled(&m->pertag->trees[clientlayers[l]][i]->node,
+					m->tagset[m->seltags] & 1u << i);
+	}
+
 	wlr_scene_node_set_enabled(&m->fullscreen_bg->node,
 			(c = focustop(m)) && c->isfullscreen);
 
 	strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, LENGTH(m->ltsymbol));
 
 	/* We move all clients (except fullscreen and unmanaged) to LyrTile while
-	 * in floating layout to avoid "real" floating clients be always on top */
+	 * in floating layout to avoid "real" floating clients be always on top.
+	 * Clients also follow their tags to the matching subtree. */
 	wl_list_for_each(c, &clients, link) {
-		if (c->mon != m || c->scene->node.parent == layers[LyrFS])
+		if (c->mon != m)
 			continue;
 
-		wlr_scene_node_reparent(&c->scene->node,
-				(!m->lt[m->sellt]->arrange && c->isfloating)
-						? layers[LyrTile]
-						: (m->lt[m->sellt]->arrange && c->isfloating)
-								? layers[LyrFloat]
-								: c->scene->node.parent);
-	}
-
-	if (m->lt[m->sellt]->arrange) {
-		if (draw_minimal_borders) {
-			int save_width = m->w.width;
-			int save_height = m->w.height;
-			m->w.width += borderpx;
-			m->w.height += borderpx;
-			resize = resizenoapply;
-			m->lt[m->sellt]->arrange(m);
-			wl_list_for_each(c, &clients, link) {
-				if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen)
-					continue;
-				if (draw_minimal_borders)
-					applyminimalborders(c, m);
-				resizeapply(c, c->geom, c->interact);
-			}
-			m->w.width = save_width;
-			m->w.height = save_height;
-			resize = resizeapply;
-		} else {
-			m->lt[m->sellt]->arrange(m);
+		setlayer(c, c->layer == LyrFS || !c->isfloating ? c->layer
+				: m->lt[m->sellt]->arrange ? LyrFloat : LyrTile);
+	}
+
+	m->arranging = 1;
+	arrangelayout(m);
+	m->arranging = 0;
+	/* Unless some client has to catch up first, the whole layout is shown
+	 * at once */
+	if (!m->layout_txn)
+		commitlayout(m);
+	/* The layout may have looked clients up in the grid before moving
+	 * them, build it again from where they are now */
+	invalidate_grid(m);
+
+	wl_list_for_each(c, &clients, link) {
+		if (c->mon != m)
+			continue;
+		if (VISIBLEON(c, m)) {
+			wlr_scene_node_set_enabled(&c->scene->node, !c->occluded && !c->covered);
+			client_set_suspended(c, c->occluded || c->covered);
 		}
+		updatevisibility(c);
 	}
+	occlusion_dirty = 1;
+	updateweights();
+
+	/* Size the clients of the hidden tags once things have settled */
+	if (!m->prelayout_idle)
+		m->prelayout_idle = wl_event_loop_add_idle(event_loop, prelayout, m);
+
 	motionnotify(0, NULL, 0, 0, 0, 0);
-	checkidleinhibitor(NULL);
 }
 
 void
@@ -738,6 +999,7 @@ arrangelayers(Monitor *m)
 	if (!m->wlr_output->enabled)
 		return;
 
+	invalidatehit();
 	if (m->scene_buffer->node.enabled) {
 		usable_area.height -= m->b.real_height;
 		usable_area.y += topbar ? m->b.real_height : 0;
@@ -770,6 +1032,37 @@ arrangelayers(Monitor *m)
 	}
 }
 
+void
+arrangelayout(Monitor *m)
+{
+	Client *c;
+	int save_width, save_height;
+	void (*apply)(Client *c, struct wlr_box geo, int interact) = resize;
+
+	if (!m->lt[m->sellt]->arrange)
+		return;
+	if (!draw_minimal_borders) {
+		m->lt[m->sellt]->arrange(m);
+		return;
+	}
+
+	save_width = m->w.width;
+	save_height = m->w.height;
+	m->w.width += borderpx;
+	m->w.height += borderpx;
+	resize = resizenoapply;
+	m->lt[m->sellt]->arrange(m);
+	wl_list_for_each(c, &clients, link) {
+		if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen || c->occluded)
+			continue;
+		applyminimalborders(c, m);
+		apply(c, c->geom, c->interact);
+	}
+	m->w.width = save_width;
+	m->w.height = save_height;
+	resize = apply;
+}
+
 void
 autostartexec(void) {
 	const char *const *p;
@@ -783,6 +1076,7 @@ autostartexec(void) {
 	for (p = autostart; *p; i++, p++) {
 		if ((autostart_pids[i] = fork()) == 0) {
 			setsid();
+			cgroupenter();
 			execvp(*p, (char *const *)p);
 			die("dwl: execvp %s:", *p);
 		}
@@ -797,6 +1091,8 @@ axisnotify(struct wl_listener *listener, void *data)
 	/* This event is forwarded by the cursor when a pointer emits an axis event,
 	 * for example when you move the scroll wheel. */
 	struct wlr_pointer_axis_event *event = data;
+	if (motion_pending)
+		pointermotion(motion_time);
 	wlr_idle_notifier_v1_notify_activity(idle_notifier, seat);
 	handlecursoractivity();
 	/* TODO: allow usage of scroll whell for mousebindings, it can be implemented
@@ -813,6 +1109,100 @@ baracceptsinput(struct wlr_scene_buffer *buffer, double *sx, double *sy)
 	return true;
 }
 
+unsigned int
+barclick(Monitor *m, double x, uint32_t *mask)
+{
+	/* Binary search of the regions drawbar() left, without measuring text */
+	int lo = 0, hi = m->nregions, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (x < m->regions[mid].end)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo == m->nregions)
+		return ClkRoot;
+	*mask = m->regions[lo].tags;
+	return m->regions[lo].click;
+}
+
+void
+bindbuttons(void)
+{
+	unsigned int c;
+	size_t i;
+
+	/* Counting sort of buttons[] by click, like bindkeys() */
+	for (i = 0; i < LENGTH(buttons); i++)
+		if (buttons[i].func && buttons[i].click < NUM_CLICKS)
+			clickstart[buttons[i].click + 1]++;
+	for (c = 1; c <= NUM_CLICKS; c++)
+		clickstart[c] += clickstart[c - 1];
+	for (i = 0; i < LENGTH(buttons); i++)
+		if (buttons[i].func && buttons[i].click < NUM_CLICKS)
+			clickbuttons[clickstart[buttons[i].click]++] = &buttons[i];
+	for (c = NUM_CLICKS; c > 0; c--)
+		clickstart[c] = clickstart[c - 1];
+	clickstart[0] = 0;
+}
+
+xkb_keycode_t
+bindkeycode(struct xkb_keymap *keymap, xkb_keycode_t keycode)
+{
+	/* The keycodes in keys[] are those of keys_keymap, see keys.h. Other
+	 * keymaps bind the key producing the same keysym on its first level. */
+	const xkb_keysym_t *syms, *s;
+	xkb_keycode_t k, max;
+
+	if (keymap == keys_keymap
+			|| xkb_keymap_key_get_syms_by_level(keys_keymap, keycode, 0, 0, &syms) < 1)
+		return keycode;
+	if (xkb_keymap_key_get_syms_by_level(keymap, keycode, 0, 0, &s) > 0 && s[0] == syms[0])
+		return keycode;
+	max = xkb_keymap_max_keycode(keymap);
+	for (k = xkb_keymap_min_keycode(keymap); k <= max; k++)
+		if (xkb_keymap_key_get_syms_by_level(keymap, k, 0, 0, &s) > 0 && s[0] == syms[0])
+			return k;
+	return 0;
+}
+
+void
+bindkeys(KeyboardGroup *group)
+{
+	struct xkb_keymap *keymap = group->wlr_group->keyboard.keymap;
+	xkb_keycode_t *keycodes = ecalloc(LENGTH(keys), sizeof(*keycodes));
+	xkb_keycode_t k;
+	size_t i;
+
+	/* Counting sort of keys[] by keycode, keeping the order of the bindings
+	 * of each key so the first match still wins in keybinding() */
+	group->maxbinding = 0;
+	for (i = 0; i < LENGTH(keys); i++) {
+		if (keys[i].func && keymap)
+			keycodes[i] = bindkeycode(keymap, keys[i].keycode);
+		group->maxbinding = MAX(group->maxbinding, keycodes[i]);
+	}
+
+	free(group->bindstart);
+	free(group->bindings);
+	group->bindstart = ecalloc(group->maxbinding + 2, sizeof(*group->bindstart));
+	group->bindings = ecalloc(LENGTH(keys), sizeof(*group->bindings));
+	for (i = 0; i < LENGTH(keys); i++)
+		if (keycodes[i])
+			group->bindstart[keycodes[i] + 1]++;
+	for (k = 1; k <= group->maxbinding + 1; k++)
+		group->bindstart[k] += group->bindstart[k - 1];
+	for (i = 0; i < LENGTH(keys); i++)
+		if (keycodes[i])
+			group->bindings[group->bindstart[keycodes[i]]++] = &keys[i];
+	for (k = group->maxbinding + 1; k > 0; k--)
+		group->bindstart[k] = group->bindstart[k - 1];
+	group->bindstart[0] = 0;
+
+	free(keycodes);
+}
+
 void
 bufdestroy(struct wlr_buffer *wlr_buffer)
 {
@@ -884,8 +1274,6 @@ bufrelease(struct wl_listener *listener, void *data)
 void
 buttonpress(struct wl_listener *listener, void *data)
 {
-	unsigned int i = 0, x = 0;
-	double cx;
 	unsigned int click;
 	struct wlr_pointer_button_event *event = data;
 	struct wlr_keyboard *keyboard;
@@ -894,8 +1282,11 @@ buttonpress(struct wl_listener *listener, void *data)
 	uint32_t mods;
 	Client *c, *target = NULL;
 	Arg arg = {0};
-	const Button *b;
+	const Button **b, **end;
 
+	/* The button goes where the pointer is now */
+	if (motion_pending)
+		pointermotion(motion_time);
 	wlr_idle_notifier_v1_notify_activity(idle_notifier, seat);
 	handlecursoractivity();
 
@@ -913,21 +1304,9 @@ buttonpress(struct wl_listener *listener, void *data)
 
 		if (!c && !exclusive_focus &&
 			(node = wlr_scene_node_at(&layers[LyrBottom]->node, cursor->x, cursor->y, NULL, NULL)) &&
-			(buffer = wlr_scene_buffer_from_node(node)) && buffer == selmon->scene_buffer) {
-			cx = (cursor->x - selmon->m.x) * selmon->wlr_output->scale;
-			do
-				x += TEXTW(selmon, tags[i]);
-			while (cx >= x && ++i < LENGTH(tags));
-			if (i < LENGTH(tags)) {
-				click = ClkTagBar;
-				arg.ui = 1 << i;
-			} else if (cx < x + TEXTW(selmon, selmon->ltsymbol))
-				click = ClkLtSymbol;
-			else if (cx > selmon->b.width - (TEXTW(selmon, stext) - selmon->lrpad + 2)) {
-				click = ClkStatus;
-			} else
-				click = ClkTitle;
-		}
+			(buffer = wlr_scene_buffer_from_node(node)) && buffer == selmon->scene_buffer)
+			click = barclick(selmon, (cursor->x - selmon->m.x) * selmon->wlr_output->scale,
+					&arg.ui);
 
 		/* Change focus if the button was _pressed_ over a client */
 		xytonode(cursor->x, cursor->y, NULL, &c, NULL, NULL, NULL);
@@ -936,12 +1315,11 @@ buttonpress(struct wl_listener *listener, void *data)
 
 		keyboard = wlr_seat_get_keyboard(seat);
 		mods = keyboard ? wlr_keyboard_get_modifiers(keyboard) : 0;
-		for (b = buttons; b < END(buttons); b++) {
-			if (CLEANMASK(mods) == CLEANMASK(b->mod) &&
-          event->button == b->button &&
-          click == b->click &&
-          b->func) {
-				b->func(click == ClkTagBar && b->arg.i == 0 ? &arg : &b->arg);
+		end = clickbuttons + clickstart[click + 1];
+		for (b = clickbuttons + clickstart[click]; b < end; b++) {
+			if (CLEANMASK(mods) == CLEANMASK((*b)->mod) &&
+          event->button == (*b)->button) {
+				(*b)->func(click == ClkTagBar && (*b)->arg.i == 0 ? &arg : &(*b)->arg);
 				return;
 			}
 		}
@@ -964,14 +1342,15 @@ buttonpress(struct wl_listener *listener, void *data)
 					arrange(selmon);
 
 				} else if (cursor_mode == CurResize && !c->isfloating) {
-					resizing_from_mouse = 0;
+					end_mouse_resize(selmon);
 				}
 			} else {
 				if (cursor_mode == CurResize && resizing_from_mouse)
-					resizing_from_mouse = 0;
+					end_mouse_resize(selmon);
 			}
 			/* Default behaviour */
 			wlr_cursor_set_xcursor(cursor, cursor_mgr, "default");
+			cursor_default = 1;
 			cursor_mode = CurNormal;
 			/* Drop the window off on its new monitor */
 			selmon = xytomon(cursor->x, cursor->y);
@@ -988,12 +1367,229 @@ buttonpress(struct wl_listener *listener, void *data)
 			event->time_msec, event->button, event->state);
 }
 
+void
+cachehit(struct wlr_scene_node *node, int layer, double x, double y,
+		double sx, double sy)
+{
+	struct wlr_scene_buffer *buffer = wlr_scene_buffer_from_node(node);
+	struct wlr_surface *surface = wlr_scene_surface_try_from_buffer(buffer)->surface;
+	int lx, ly, above = 0;
+
+	/* Only surfaces taking input everywhere, that are shown unscaled, are
+	 * simple enough to be cached */
+	if (buffer->transform != WL_OUTPUT_TRANSFORM_NORMAL
+			|| !buffer->dst_width || !buffer->dst_height
+			|| (buffer->src_box.width && (buffer->src_box.width != buffer->dst_width
+				|| buffer->src_box.height != buffer->dst_height))
+			|| pixman_region32_contains_rectangle(&surface->input_region,
+				&(pixman_box32_t){0, 0, surface->current.width,
+				surface->current.height}) != PIXMAN_REGION_IN
+			|| !wlr_scene_node_coords(node, &lx, &ly))
+		return;
+
+	hitcache.node = node;
+	hitcache.box = (struct wlr_box){lx, ly, buffer->dst_width, buffer->dst_height};
+	hitcache.lx = lx;
+	hitcache.ly = ly;
+	hitcache.x = x - sx;
+	hitcache.y = y - sy;
+
+	/* Cut away whatever is stacked above it */
+	for (; layer < NUM_LAYERS && !wlr_box_empty(&hitcache.box); layer++)
+		cliphit(&layers[layer]->node, 0, 0, x, y, &above);
+	if (wlr_box_empty(&hitcache.box)) {
+		hitcache.node = NULL;
+		return;
+	}
+	hitcache.destroy.notify = hitdestroy;
+	wl_signal_add(&node->events.destroy, &hitcache.destroy);
+}
+
+void
+cgroupenter(void)
+{
+	char path[PATH_MAX + 32];
+	int fd;
+
+	/* Runs in a freshly forked child, which gets a leaf of its own */
+	if (!cgroup_path[0])
+		return;
+	snprintf(path, sizeof(path), "%s/app-%d", cgroup_path, (int)getpid());
+	if (mkdir(path, 0755) < 0)
+		return;
+	snprintf(path, sizeof(path), "%s/app-%d/cgroup.procs", cgroup_path, (int)getpid());
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return;
+	if (write(fd, "0", 1) < 0)
+		fprintf(stderr, "dwl: cannot move into %s\n", path);
+	close(fd);
+}
+
+void
+cgroupinit(void)
+{
+	char line[PATH_MAX], path[PATH_MAX + 32];
+	FILE *f;
+	int fd;
+
+	if (!cgroups || !(f = fopen("/proc/self/cgroup", "r")))
+		return;
+	/* Only the unified hierarchy is supported */
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "0::", 3)) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(cgroup_path, sizeof(cgroup_path), "/sys/fs/cgroup%s",
+					strcmp(line + 3, "/") ? line + 3 : "");
+			break;
+		}
+	}
+	fclose(f);
+	if (!cgroup_path[0])
+		return;
+
+	/* A cgroup with processes in it cannot hand controllers down to its
+	 * children, so dwl moves into a leaf next to the ones it creates. */
+	snprintf(path, sizeof(path), "%s/dwl", cgroup_path);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		goto fail;
+	snprintf(path, sizeof(path), "%s/dwl/cgroup.procs", cgroup_path);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		goto fail;
+	if (write(fd, "0", 1) < 0) {
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_path);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		goto fail;
+	if (write(fd, "+cpu +io", 8) < 0)
+		fprintf(stderr, "dwl: cannot enable cpu and io controllers in %s\n", cgroup_path);
+	close(fd);
+	return;
+
+fail:
+	fprintf(stderr, "dwl: cannot manage cgroups under %s\n", cgroup_path);
+	cgroup_path[0] = '\0';
+}
+
+pid_t
+cgroupscope(pid_t pid)
+{
+	char line[PATH_MAX], path[64];
+	const char *leaf;
+	size_t len;
+	FILE *f;
+	int scope = 0;
+
+	if (!cgroup_path[0] || pid <= 0)
+		return 0;
+	len = strlen(cgroup_path) - strlen("/sys/fs/cgroup");
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	/* Children of spawned commands inherit their leaf */
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		leaf = line + 3;
+		if (!strncmp(leaf, cgroup_path + strlen("/sys/fs/cgroup"), len)
+				&& !strncmp(leaf + len, "/app-", 5))
+			scope = atoi(leaf + len + 5);
+		break;
+	}
+	fclose(f);
+	return scope;
+}
+
+void
+cgroupsweep(void)
+{
+	char path[PATH_MAX + 32];
+	struct dirent *ent;
+	DIR *dir;
+	int pid;
+
+	/* Remove the leaves whose first process is gone, including those left
+	 * behind by commands that daemonized. rmdir() fails while anything
+	 * still runs in a leaf, and a live pid may not have moved in yet. */
+	if (!cgroup_path[0] || !(dir = opendir(cgroup_path)))
+		return;
+	while ((ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "app-%d", &pid) != 1 || pid <= 0
+				|| !kill(pid, 0) || errno != ESRCH)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cgroup_path, ent->d_name);
+		rmdir(path);
+	}
+	closedir(dir);
+}
+
+void
+cgroupwrite(pid_t scope, const char *file, const char *fmt, unsigned int value)
+{
+	char path[PATH_MAX + 64], buf[32];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/app-%d/%s", cgroup_path, (int)scope, file);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), fmt, value);
+	if (write(fd, buf, (size_t)len) < 0)
+		fprintf(stderr, "dwl: cannot write %s\n", path);
+	close(fd);
+}
+
+void
+childnotify(void)
+{
+	siginfo_t in;
+	Client *c, *w;
+
+	cgroupsweep();
+
+	/* Consume the stop and continue notifications of the clients dwl
+	 * spawned, exits are left to handlesig() */
+	wl_list_for_each(c, &clients, link) {
+		if (!c->ischild)
+			continue;
+		in.si_pid = 0;
+		if (waitid(P_PID, c->pid, &in, WSTOPPED|WCONTINUED|WNOHANG) || !in.si_pid)
+			continue;
+		wl_list_for_each(w, &clients, link) {
+			if (w->pid == c->pid)
+				setstopped(w, in.si_code != CLD_CONTINUED);
+		}
+	}
+}
+
 void
 chvt(const Arg *arg)
 {
 	wlr_session_change_vt(session, arg->ui);
 }
 
+void
+checkconstraint(void)
+{
+	struct wlr_pointer_constraint_v1 *constraint = NULL;
+
+	/* Only the surface with pointer focus may have its constraint active */
+	if (seat->pointer_state.focused_surface == constraint_surface)
+		return;
+	constraint_surface = seat->pointer_state.focused_surface;
+	if (constraint_surface)
+		constraint = wlr_pointer_constraints_v1_constraint_for_surface(
+				pointer_constraints, constraint_surface, seat);
+	if (constraint) {
+		cursorconstrain(constraint);
+	} else if (active_constraint) {
+		wlr_pointer_constraint_v1_send_deactivated(active_constraint);
+		active_constraint = NULL;
+	}
+}
+
 void
 checkidleinhibitor(struct wlr_surface *exclude)
 {
@@ -1002,11 +1598,18 @@ checkidleinhibitor(struct wlr_surface *exclude)
 	wl_list_for_each(inhibitor, &idle_inhibit_mgr->inhibitors, link) {
 		struct wlr_surface *surface = wlr_surface_get_root_surface(inhibitor->surface);
 		struct wlr_scene_tree *tree = surface->data;
-		if (exclude != surface && (bypass_surface_visibility || (!tree
-				|| wlr_scene_node_coords(&tree->node, &unused_lx, &unused_ly)))) {
-			inhibited = 1;
-			break;
+		Client *c = NULL;
+		if (exclude == surface)
+			continue;
+		if (!bypass_surface_visibility && tree) {
+			/* Managed clients keep track of it, see updatevisibility() */
+			toplevel_from_wlr_surface(surface, &c, NULL);
+			if (c && c->visibility != VisUnknown ? c->visibility < VisPartial
+					: !wlr_scene_node_coords(&tree->node, &unused_lx, &unused_ly))
+				continue;
 		}
+		inhibited = 1;
+		break;
 	}
 
 	wlr_idle_notifier_v1_set_inhibited(idle_notifier, inhibited);
@@ -1016,6 +1619,13 @@ void
 cleanup(void)
 {
 	size_t i;
+	Client *c;
+
+	/* Do not leave stopped processes behind */
+	wl_list_for_each(c, &clients, link) {
+		if (c->frozen)
+			freezeclient(c, 0);
+	}
 #ifdef XWAYLAND
 	wlr_xwayland_destroy(xwayland);
 	xwayland = NULL;
@@ -1037,12 +1647,14 @@ cleanup(void)
 	wlr_xcursor_manager_destroy(cursor_mgr);
 
 	destroykeyboardgroup(&kb_group->destroy, NULL);
+	xkb_keymap_unref(keys_keymap);
 
 	/* If it's not destroyed manually it will cause a use-after-free of wlr_seat.
 	 * Destroy it until it's fixed in the wlroots side */
 	wlr_backend_destroy(backend);
 
 	wl_display_destroy(dpy);
+	wl_event_loop_destroy(input_loop);
 	/* Destroy after the wayland display (when the monitors are already destroyed)
 	   to avoid destroying them with an invalid scene output. */
 	wlr_scene_node_destroy(&scene->tree.node);
@@ -1054,17 +1666,21 @@ void
 cleanupmon(struct wl_listener *listener, void *data)
 {
 	Monitor *m = wl_container_of(listener, m, destroy);
-	LayerSurface *l, *tmp;
-	size_t i;
+	LayerSurface *ls, *tmp;
+	struct wlr_scene_node *node, *tmpnode;
+	size_t i, l;
 
 	DwlIpcOutput *ipc_output, *ipc_output_tmp;
 	wl_list_for_each_safe(ipc_output, ipc_output_tmp, &m->dwl_ipc_outputs, link)
 		wl_resource_destroy(ipc_output->resource);
 
+	if (latency_probe.mon == m)
+		latency_probe.input = 0;
+
 	/* m->layers[i] are intentionally not unlinked */
 	for (i = 0; i < LENGTH(m->layers); i++) {
-		wl_list_for_each_safe(l, tmp, &m->layers[i], link)
-			wlr_layer_surface_v1_destroy(l->layer_surface);
+		wl_list_for_each_safe(ls, tmp, &m->layers[i], link)
+			wlr_layer_surface_v1_destroy(ls->layer_surface);
 	}
 
 	for (i = 0; i < LENGTH(m->pool); i++)
@@ -1075,20 +1691,93 @@ cleanupmon(struct wl_listener *listener, void *data)
 
 	wl_list_remove(&m->destroy.link);
 	wl_list_remove(&m->frame.link);
+	wl_list_remove(&m->present.link);
 	wl_list_remove(&m->link);
 	wl_list_remove(&m->request_state.link);
 	m->wlr_output->data = NULL;
 	wlr_output_layout_remove(output_layout, m->wlr_output);
 	wlr_scene_output_destroy(m->scene_output);
 
-	free(m->pertag);
 	destroy_tree(m);
+	destroy_grid(m);
+	commitlayout(m);
+	wl_event_source_remove(m->layout_txn_timer);
+	wl_event_source_remove(m->frame_timer);
+	wl_event_source_remove(m->fps_timer);
+	if (m->prelayout_idle)
+		wl_event_source_remove(m->prelayout_idle);
 	closemon(m);
+	/* Clients left without a monitor go back to the layers themselves */
+	for (l = 0; l < LENGTH(clientlayers); l++) {
+		for (i = 0; i <= TAGCOUNT; i++) {
+			wl_list_for_each_safe(node, tmpnode,
+					&m->pertag->trees[clientlayers[l]][i]->children, link)
+				wlr_scene_node_reparent(node, layers[clientlayers[l]]);
+			wlr_scene_node_destroy(&m->pertag->trees[clientlayers[l]][i]->node);
+		}
+	}
+	free(m->pertag);
+	free(m->regions);
 	wlr_scene_node_destroy(&m->fullscreen_bg->node);
 	wlr_scene_node_destroy(&m->scene_buffer->node);
 	free(m);
 }
 
+void
+cliphit(struct wlr_scene_node *node, int lx, int ly, double x, double y,
+		int *above)
+{
+	struct wlr_scene_node *child;
+	struct wlr_scene_buffer *buffer;
+	struct wlr_scene_rect *rect;
+	struct wlr_box box, parts[4], *hit = &hitcache.box, *best = NULL;
+	int i;
+
+	if (!node->enabled || wlr_box_empty(hit))
+		return;
+	lx += node->x;
+	ly += node->y;
+	if (node == hitcache.node) {
+		*above = 1;
+		return;
+	}
+	if (node->type == WLR_SCENE_NODE_TREE) {
+		wl_list_for_each(child, &wlr_scene_tree_from_node(node)->children, link)
+			cliphit(child, lx, ly, x, y, above);
+		return;
+	}
+	if (!*above)
+		return;
+
+	if (node->type == WLR_SCENE_NODE_RECT) {
+		rect = wlr_scene_rect_from_node(node);
+		box = (struct wlr_box){lx, ly, rect->width, rect->height};
+	} else {
+		buffer = wlr_scene_buffer_from_node(node);
+		box = (struct wlr_box){lx, ly, buffer->dst_width, buffer->dst_height};
+		/* Without a destination size it is the buffer's, maybe transformed */
+		if (!box.width || !box.height)
+			box.width = box.height = buffer->buffer
+					? MAX(buffer->buffer->width, buffer->buffer->height) : 0;
+	}
+	if (!wlr_box_intersection(&box, &box, hit))
+		return;
+
+	/* Keep the largest part of the box on the side of the pointer */
+	parts[0] = (struct wlr_box){hit->x, hit->y, box.x - hit->x, hit->height};
+	parts[1] = (struct wlr_box){box.x + box.width, hit->y,
+			hit->x + hit->width - box.x - box.width, hit->height};
+	parts[2] = (struct wlr_box){hit->x, hit->y, hit->width, box.y - hit->y};
+	parts[3] = (struct wlr_box){hit->x, box.y + box.height,
+			hit->width, hit->y + hit->height - box.y - box.height};
+	for (i = 0; i < 4; i++) {
+		if (wlr_box_contains_point(&parts[i], x, y) && (!best
+				|| parts[i].width * parts[i].height > best->width * best->height))
+			best = &parts[i];
+	}
+	*hit = best ? *best : (struct wlr_box){0};
+}
+
 void
 closemon(Monitor *m)
 {
@@ -1119,6 +1808,125 @@ closemon(Monitor *m)
 	drawbars();
 }
 
+void
+commitframe(Monitor *m)
+{
+	Client *c;
+	struct wlr_output_state pending = {0};
+	struct wlr_gamma_control_v1 *gamma_control;
+	int64_t now_msec, next_deadline = 0;
+	int64_t start = monotonicusec(), end;
+	int dirty;
+
+	/* Devices that do not send frame events get their motion handled here */
+	if (motion_pending)
+		pointermotion(motion_time);
+
+	/* Pace interactive tiled resizing to this output's frames */
+	apply_mouse_resize(m);
+
+	if (occlusion_dirty)
+		updateocclusion();
+
+	/* Apply a pending layout once every client taking part in it has acked
+	 * its configure or run out of time, until then their snapshots are
+	 * rendered instead. The clients are only walked once a deadline passed. */
+	if (m->layout_txn && m->pendingresizes && m->layout_txn_late) {
+		m->layout_txn_late = 0;
+		now_msec = monotonicmsec();
+		wl_list_for_each(c, &clients, link) {
+			if (c->resizemon != m)
+				continue;
+			if (now_msec >= c->resize_deadline)
+				stallbegin(c);
+			else if (!next_deadline || c->resize_deadline < next_deadline)
+				next_deadline = c->resize_deadline;
+		}
+		if (next_deadline)
+			wl_event_source_timer_update(m->layout_txn_timer,
+					(int)MAX(1, next_deadline - now_msec));
+	}
+	if (m->layout_txn && !m->pendingresizes)
+		commitlayout(m);
+
+	dirty = wlr_scene_output_needs_frame(m->scene_output);
+	if (dirty && m->layout_txn)
+		m->stats.skipped++;
+
+	/*
+	 * HACK: The "correct" way to set the gamma is to commit it together with
+	 * the rest of the state in one go, but to do that we would need to rewrite
+	 * wlr_scene_output_commit() in order to add the gamma to the pending
+	 * state before committing, instead try to commit the gamma in one frame,
+	 * and commit the rest of the state in the next one (or in the same frame if
+	 * the gamma can not be committed).
+	 */
+	if (m->gamma_lut_changed) {
+		gamma_control
+				= wlr_gamma_control_manager_v1_get_control(gamma_control_mgr, m->wlr_output);
+		m->gamma_lut_changed = 0;
+
+		if (!wlr_gamma_control_v1_apply(gamma_control, &pending))
+			goto commit;
+
+		if (!wlr_output_test_state(m->wlr_output, &pending)) {
+			wlr_gamma_control_v1_send_failed_and_destroy(gamma_control);
+			goto commit;
+		}
+		if (!wlr_output_commit_state(m->wlr_output, &pending))
+			m->stats.failed++;
+		wlr_output_schedule_frame(m->wlr_output);
+		/* The scene follows on the next frame */
+		dirty = 0;
+	} else {
+commit:
+		if (!wlr_scene_output_commit(m->scene_output, NULL)) {
+			m->stats.failed++;
+			dirty = 0;
+		}
+	}
+
+	/* Only frames that were actually composed and committed are counted,
+	 * the others would drag the compose times towards zero */
+	end = monotonicusec();
+	if (dirty) {
+		m->stats.compose[m->stats.frames++ % LENGTH(m->stats.compose)] = (int)(end - start);
+		m->stats.committed = end;
+	}
+	/* Whether a delayed frame made its vblank is only known once it is
+	 * presented, see presentmon() */
+	if (m->frame_deadline && dirty) {
+		m->frame_target = m->frame_deadline;
+		m->frame_seq = m->wlr_output->commit_seq;
+	} else if (!m->frame_deadline && m->framebackoff) {
+		m->framebackoff--;
+	}
+
+	/* Let clients know a frame has been rendered, including the ones that
+	 * are hidden behind their snapshot so they can draw their new size. */
+	clock_gettime(CLOCK_MONOTONIC, &m->frame_time);
+	wlr_scene_output_for_each_buffer(m->scene_output, sendframedone, m);
+	wl_list_for_each(c, &clients, link) {
+		if (c->mon == m && c->snapshot)
+			wlr_surface_send_frame_done(client_surface(c), &m->frame_time);
+	}
+	wlr_output_state_finish(&pending);
+}
+
+void
+commithit(struct wlr_surface *surface)
+{
+	/* New contents keep the pointer where it is, a new input region or size
+	 * does not. Subsurfaces commit out of sight, so surfaces having any drop
+	 * the cache on every commit. */
+	if ((surface->current.committed & WLR_SURFACE_STATE_INPUT_REGION)
+			|| surface->current.width != surface->previous.width
+			|| surface->current.height != surface->previous.height
+			|| !wl_list_empty(&surface->current.subsurfaces_below)
+			|| !wl_list_empty(&surface->current.subsurfaces_above))
+		invalidatehit();
+}
+
 void
 commitlayersurfacenotify(struct wl_listener *listener, void *data)
 {
@@ -1127,6 +1935,9 @@ commitlayersurfacenotify(struct wl_listener *listener, void *data)
 	struct wlr_scene_tree *scene_layer = layers[layermap[layer_surface->current.layer]];
 	struct wlr_layer_surface_v1_state old_state;
 
+	commithit(layer_surface->surface);
+	latencycommit(layer_surface->surface);
+
 	if (l->layer_surface->initial_commit) {
 		wlr_fractional_scale_v1_notify_scale(layer_surface->surface, l->mon->wlr_output->scale);
 		wlr_surface_set_preferred_buffer_scale(layer_surface->surface, (int32_t)ceilf(l->mon->wlr_output->scale));
@@ -1155,11 +1966,30 @@ commitlayersurfacenotify(struct wl_listener *listener, void *data)
 	arrangelayers(l->mon);
 }
 
+void
+commitlayout(Monitor *m)
+{
+	Client *c;
+
+	/* Swap every snapshot on this monitor for the live surface at once,
+	 * together with the new positions and borders. */
+	wl_list_for_each(c, &clients, link) {
+		if (c->mon == m && (c->snapshot || c->scenepending))
+			resizescene(c);
+	}
+	m->layout_txn = m->layout_txn_late = 0;
+	wl_event_source_timer_update(m->layout_txn_timer, 0);
+}
+
 void
 commitnotify(struct wl_listener *listener, void *data)
 {
 	Client *c = wl_container_of(listener, c, commit);
+	const struct wlr_alpha_modifier_surface_v1_state *alpha;
+	struct wlr_box geom;
 
+	commithit(client_surface(c));
+	latencycommit(client_surface(c));
 	if (c->surface.xdg->initial_commit) {
 		/*
 		 * Get the monitor this client will be rendered on
@@ -1170,10 +2000,19 @@ commitnotify(struct wl_listener *listener, void *data)
 		applyrules(c);
 		wlr_surface_set_preferred_buffer_scale(client_surface(c), (int)ceilf(c->mon->wlr_output->scale));
 		wlr_fractional_scale_v1_notify_scale(client_surface(c), c->mon->wlr_output->scale);
+
+		/* Send the tiled size right away, so the first buffer already fits
+		 * and mapping does not need another configure */
+		if (predictgeom(c, &geom)) {
+			client_set_tiled(c, WLR_EDGE_TOP | WLR_EDGE_BOTTOM | WLR_EDGE_LEFT | WLR_EDGE_RIGHT);
+			wlr_xdg_toplevel_set_size(c->surface.xdg->toplevel,
+					geom.width - 2 * (int)c->bw, geom.height - 2 * (int)c->bw);
+		} else {
+			wlr_xdg_toplevel_set_size(c->surface.xdg->toplevel, 0, 0);
+		}
 		setmon(c, NULL, 0); /* Make sure to reapply rules in mapnotify() */
 
 		wlr_xdg_toplevel_set_wm_capabilities(c->surface.xdg->toplevel, WLR_XDG_TOPLEVEL_WM_CAPABILITIES_FULLSCREEN);
-		wlr_xdg_toplevel_set_size(c->surface.xdg->toplevel, 0, 0);
 		if (c->decoration)
 			requestdecorationmode(&c->set_decoration_mode, c->decoration);
 		return;
@@ -1182,23 +2021,53 @@ commitnotify(struct wl_listener *listener, void *data)
 	if (client_surface(c)->mapped && c->mon)
 		resize(c, c->geom, (c->isfloating && !c->isfullscreen));
 
+	if (client_surface(c)->current.committed & WLR_SURFACE_STATE_OPAQUE_REGION)
+		occlusion_dirty = 1;
+	if (((alpha = wlr_alpha_modifier_v1_get_surface_state(client_surface(c)))
+			&& alpha->multiplier < 1.0) != c->translucent) {
+		c->translucent = !c->translucent;
+		occlusion_dirty = 1;
+	}
+	if ((client_surface(c)->current.committed
+			& (WLR_SURFACE_STATE_BUFFER | WLR_SURFACE_STATE_OPAQUE_REGION))
+			&& c->border[0] && !c->snapshot && solidborder(c) != c->solidborder)
+		updateborder(c);
+
 	/* mark a pending resize as completed */
-	if (c->resize && c->resize <= c->surface.xdg->current.configure_serial)
+	if (c->resize && c->resize <= c->surface.xdg->current.configure_serial) {
 		c->resize = 0;
+		if (c->isslow)
+			stallend(c);
+		updatepending(c);
+		/* Let a pending layout or a held back mouse resize step go out on
+		 * the next frame */
+		if ((c->snapshot || resize_motion_pending) && c->mon)
+			wlr_output_schedule_frame(c->mon->wlr_output);
+	}
 }
 
 void
 commitpopup(struct wl_listener *listener, void *data)
 {
+	Popup *p = wl_container_of(listener, p, commit);
 	struct wlr_surface *surface = data;
-	struct wlr_xdg_popup *popup = wlr_xdg_popup_try_from_wlr_surface(surface);
+	struct wlr_xdg_popup *popup = p->popup;
 	LayerSurface *l = NULL;
 	Client *c = NULL;
 	struct wlr_box box;
 	int type = -1;
 
-	if (!popup->base->initial_commit)
+	if (!popup->base->initial_commit) {
+		/* Showing, hiding or moving the popup changes what it covers */
+		if (surface->mapped != p->mapped
+				|| !wlr_box_equal(&popup->current.geometry, &p->geom))
+			invalidatehit();
+		else
+			commithit(surface);
+		p->mapped = surface->mapped;
+		p->geom = popup->current.geometry;
 		return;
+	}
 
 	type = toplevel_from_wlr_surface(popup->base->surface, &c, &l);
 	if (!popup->parent || type < 0)
@@ -1211,7 +2080,6 @@ commitpopup(struct wl_listener *listener, void *data)
 	box.x -= (type == LayerShell ? l->geom.x : c->geom.x);
 	box.y -= (type == LayerShell ? l->geom.y : c->geom.y);
 	wlr_xdg_popup_unconstrain_from_box(popup, &box);
-	wl_list_remove(&listener->link);
 }
 
 void
@@ -1263,14 +2131,18 @@ createkeyboardgroup(void)
 		die("failed to compile keymap");
 
 	wlr_keyboard_set_keymap(&group->wlr_group->keyboard, keymap);
+	if (!keys_keymap)
+		keys_keymap = xkb_keymap_ref(keymap);
 	xkb_keymap_unref(keymap);
 	xkb_context_unref(context);
+	bindkeys(group);
 
 	wlr_keyboard_set_repeat_info(&group->wlr_group->keyboard, repeat_rate, repeat_delay);
 
 	/* Set up listeners for keyboard events */
 	LISTEN(&group->wlr_group->keyboard.events.key, &group->key, keypress);
 	LISTEN(&group->wlr_group->keyboard.events.modifiers, &group->modifiers, keypressmod);
+	LISTEN(&group->wlr_group->keyboard.events.keymap, &group->keymap, keymapnotify);
 
 	group->key_repeat_source = wl_event_loop_add_timer(event_loop, keyrepeat, group);
 
@@ -1341,9 +2213,10 @@ createmon(struct wl_listener *listener, void *data)
 	 * monitor) becomes available. */
 	struct wlr_output *wlr_output = data;
 	const MonitorRule *r;
-	size_t i;
+	size_t i, j;
 	struct wlr_output_state state;
-	Monitor *m;
+	uint32_t bits = 0;
+	Monitor *m, *mon;
 
 	if (!wlr_output_init_render(wlr_output, alloc, drw))
 		return;
@@ -1370,6 +2243,7 @@ createmon(struct wl_listener *listener, void *data)
 			strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, LENGTH(m->ltsymbol));
 			wlr_output_state_set_scale(&state, r->scale);
 			wlr_output_state_set_transform(&state, r->rr);
+			m->framedelay = r->framedelay;
 			break;
 		}
 	}
@@ -1382,6 +2256,7 @@ createmon(struct wl_listener *listener, void *data)
 
 	/* Set up event listeners */
 	LISTEN(&wlr_output->events.frame, &m->frame, rendermon);
+	LISTEN(&wlr_output->events.present, &m->present, presentmon);
 	LISTEN(&wlr_output->events.destroy, &m->destroy, cleanupmon);
 	LISTEN(&wlr_output->events.request_state, &m->request_state, requestmonstate);
 
@@ -1396,11 +2271,22 @@ createmon(struct wl_listener *listener, void *data)
 	m->scene_buffer->point_accepts_input = baracceptsinput;
 	updatebar(m);
 
+	/* Lowest bit not taken by another monitor */
+	wl_list_for_each(mon, &mons, link)
+		bits |= mon->bit;
+	m->bit = ~bits & (bits + 1);
+
 	wl_list_insert(&mons, &m->link);
 	printstatus();
 	init_tree(m);
+	init_grid(m);
+	m->layout_txn_timer = wl_event_loop_add_timer(event_loop, layouttimeout, m);
+	/* On the backend's loop, so client traffic can't push it past the vblank */
+	m->frame_timer = wl_event_loop_add_timer(input_loop, delayedframe, m);
+	m->fps_timer = wl_event_loop_add_timer(event_loop, fpstimeout, m);
 
 	m->pertag = calloc(1, sizeof(Pertag));
+	m->regions = ecalloc(LENGTH(tags) + 3, sizeof(*m->regions));
 	m->pertag->curtag = m->pertag->prevtag = 1;
 
 	for (i = 0; i <= TAGCOUNT; i++) {
@@ -1425,6 +2311,13 @@ createmon(struct wl_listener *listener, void *data)
 	m->fullscreen_bg = wlr_scene_rect_create(layers[LyrFS], 0, 0, fullscreen_bg);
 	wlr_scene_node_set_enabled(&m->fullscreen_bg->node, 0);
 
+	/* The clients of each layer are grouped by tag, so that switching tags
+	 * only flips the subtrees, see tagindex() */
+	for (i = 0; i < LENGTH(clientlayers); i++) {
+		for (j = 0; j <= TAGCOUNT; j++)
+			m->pertag->trees[clientlayers[i]][j] = wlr_scene_tree_create(layers[clientlayers[i]]);
+	}
+
 	/* Adds this to the output layout in the order it was configured.
 	 *
 	 * The output layout utility automatically adds a wl_output global to the
@@ -1510,6 +2403,8 @@ createpointerconstraint(struct wl_listener *listener, void *data)
 	pointer_constraint->constraint = data;
 	LISTEN(&pointer_constraint->constraint->events.destroy,
 			&pointer_constraint->destroy, destroypointerconstraint);
+	/* Looked up again before the next motion, see checkconstraint() */
+	constraint_surface = NULL;
 }
 
 void
@@ -1518,7 +2413,11 @@ createpopup(struct wl_listener *listener, void *data)
 	/* This event is raised when a client (either xdg-shell or layer-shell)
 	 * creates a new popup. */
 	struct wlr_xdg_popup *popup = data;
-	LISTEN_STATIC(&popup->base->surface->events.commit, commitpopup);
+	Popup *p = ecalloc(1, sizeof(*p));
+
+	p->popup = popup;
+	LISTEN(&popup->base->surface->events.commit, &p->commit, commitpopup);
+	LISTEN(&popup->events.destroy, &p->destroy, destroypopup);
 }
 
 void
@@ -1541,6 +2440,9 @@ cursorframe(struct wl_listener *listener, void *data)
 	 * event. Frame events are sent after regular pointer events to group
 	 * multiple events together. For instance, two axis events may happen at the
 	 * same time, in which case a frame event won't be sent in between. */
+	/* Motion of the whole frame is handled at once */
+	if (motion_pending)
+		pointermotion(motion_time);
 	/* Notify the client with pointer focus of the frame event. */
 	wlr_seat_pointer_notify_frame(seat);
 }
@@ -1559,6 +2461,15 @@ cursorwarptohint(void)
 	}
 }
 
+int
+delayedframe(void *data)
+{
+	Monitor *m = data;
+	m->framedelayed = 0;
+	commitframe(m);
+	return 0;
+}
+
 void
 destroydecoration(struct wl_listener *listener, void *data)
 {
@@ -1590,6 +2501,11 @@ destroylayersurfacenotify(struct wl_listener *listener, void *data)
 {
 	LayerSurface *l = wl_container_of(listener, l, destroy);
 
+	/* A new surface may get the same address */
+	if (latency_probe.surface == l->layer_surface->surface) {
+		latency_probe.input = 0;
+		latency_probe.surface = NULL;
+	}
 	wl_list_remove(&l->link);
 	wl_list_remove(&l->destroy.link);
 	wl_list_remove(&l->unmap.link);
@@ -1606,6 +2522,7 @@ destroylock(SessionLock *lock, int unlock)
 	if ((locked = !unlock))
 		goto destroy;
 
+	invalidatehit();
 	wlr_scene_node_set_enabled(&locked_bg->node, 0);
 
 	focusclient(focustop(selmon), 0);
@@ -1648,6 +2565,11 @@ destroynotify(struct wl_listener *listener, void *data)
 {
 	/* Called when the xdg_toplevel is destroyed. */
 	Client *c = wl_container_of(listener, c, destroy);
+	/* A new surface may get the same address */
+	if (latency_probe.surface && latency_probe.surface == client_surface(c)) {
+		latency_probe.input = 0;
+		latency_probe.surface = NULL;
+	}
 	wl_list_remove(&c->destroy.link);
 	wl_list_remove(&c->set_title.link);
 	wl_list_remove(&c->fullscreen.link);
@@ -1681,11 +2603,22 @@ destroypointerconstraint(struct wl_listener *listener, void *data)
 		cursorwarptohint();
 		active_constraint = NULL;
 	}
+	constraint_surface = NULL;
 
 	wl_list_remove(&pointer_constraint->destroy.link);
 	free(pointer_constraint);
 }
 
+void
+destroypopup(struct wl_listener *listener, void *data)
+{
+	Popup *p = wl_container_of(listener, p, destroy);
+
+	wl_list_remove(&p->commit.link);
+	wl_list_remove(&p->destroy.link);
+	free(p);
+}
+
 void
 destroysessionlock(struct wl_listener *listener, void *data)
 {
@@ -1708,7 +2641,10 @@ destroykeyboardgroup(struct wl_listener *listener, void *data)
 	wlr_keyboard_group_destroy(group->wlr_group);
 	wl_list_remove(&group->key.link);
 	wl_list_remove(&group->modifiers.link);
+	wl_list_remove(&group->keymap.link);
 	wl_list_remove(&group->destroy.link);
+	free(group->bindings);
+	free(group->bindstart);
 	free(group);
 }
 
@@ -1728,6 +2664,40 @@ dirtomon(enum wlr_direction dir)
 	return selmon;
 }
 
+void
+dumpstats(void)
+{
+	Monitor *m;
+	unsigned int ni, nc;
+	size_t i;
+
+	fprintf(stderr, "dwl: %u loop turns, %u cut short by input, %u out of budget\n",
+			loop_stats.turns, loop_stats.preempted, loop_stats.exhausted);
+	if (loop_stats.preempted)
+		fprintf(stderr, "  input waited %lld us on average, worst %lld us\n",
+				(long long)(loop_stats.latency_total / loop_stats.preempted),
+				(long long)loop_stats.latency_max);
+	wl_list_for_each(m, &mons, link) {
+		ni = MIN(m->stats.presents, LENGTH(m->stats.interval));
+		nc = MIN(m->stats.frames, LENGTH(m->stats.compose));
+		fprintf(stderr, "dwl: %s: %u frames, %u skipped, %u failed, %u missed\n",
+				m->wlr_output->name, m->stats.frames, m->stats.skipped,
+				m->stats.failed, m->stats.missed);
+		fprintf(stderr, "  interval p50 %d us, p99 %d us; compose p50 %d us, p99 %d us\n",
+				ringpercentile(m->stats.interval, ni, 50), ringpercentile(m->stats.interval, ni, 99),
+				ringpercentile(m->stats.compose, nc, 50), ringpercentile(m->stats.compose, nc, 99));
+		if (m->latency.samples)
+			fprintf(stderr, "  input latency p50 %u us, p99 %u us over %u inputs\n",
+					histpercentile(&m->latency, 50), histpercentile(&m->latency, 99),
+					m->latency.samples);
+	}
+	fprintf(stderr, "dwl: %u configure stalls\n", stall_count);
+	for (i = 0; i < LENGTH(stall_worst) && stall_worst[i].stalls; i++)
+		fprintf(stderr, "  %s: %u stalls, worst %lld ms, total %lld ms\n",
+				stall_worst[i].appid, stall_worst[i].stalls,
+				(long long)stall_worst[i].worst, (long long)stall_worst[i].total);
+}
+
 void
 dwl_ipc_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
 {
@@ -1781,6 +2751,35 @@ dwl_ipc_output_destroy(struct wl_resource *resource)
 	free(ipc_output);
 }
 
+void
+dwl_ipc_output_get_frame_stats(struct wl_client *client, struct wl_resource *resource)
+{
+	DwlIpcOutput *ipc_output = wl_resource_get_user_data(resource);
+	Monitor *m;
+	unsigned int ni, nc;
+	if (!ipc_output)
+		return;
+	m = ipc_output->mon;
+	ni = MIN(m->stats.presents, LENGTH(m->stats.interval));
+	nc = MIN(m->stats.frames, LENGTH(m->stats.compose));
+	zdwl_ipc_output_v2_send_frame_stats(resource, m->stats.frames,
+			ringpercentile(m->stats.interval, ni, 50), ringpercentile(m->stats.interval, ni, 99),
+			ringpercentile(m->stats.compose, nc, 50), ringpercentile(m->stats.compose, nc, 99),
+			m->stats.skipped, m->stats.failed, m->stats.missed);
+}
+
+void
+dwl_ipc_output_get_latency(struct wl_client *client, struct wl_resource *resource)
+{
+	DwlIpcOutput *ipc_output = wl_resource_get_user_data(resource);
+	Histogram *h;
+	if (!ipc_output)
+		return;
+	h = &ipc_output->mon->latency;
+	zdwl_ipc_output_v2_send_latency(resource, h->samples,
+			histpercentile(h, 50), histpercentile(h, 99));
+}
+
 void
 dwl_ipc_output_printstatus(Monitor *monitor)
 {
@@ -1965,8 +2964,10 @@ drawbar(Monitor *m)
 	}
 	x = 0;
 	c = focustop(m);
+	m->nregions = 0;
 	for (i = 0; i < LENGTH(tags); i++) {
 		w = TEXTW(m, tags[i]);
+		m->regions[m->nregions++] = (BarRegion){x + w, ClkTagBar, 1u << i};
 		drwl_setscheme(m->drw, colors[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
 		drwl_text(m->drw, x, 0, w, m->b.height, m->lrpad / 2, tags[i], urg & 1 << i);
 		if (occ & 1 << i)
@@ -1978,6 +2979,11 @@ drawbar(Monitor *m)
 	w = TEXTW(m, m->ltsymbol);
 	drwl_setscheme(m->drw, colors[SchemeNorm]);
 	x = drwl_text(m->drw, x, 0, w, m->b.height, m->lrpad / 2, m->ltsymbol, 0);
+	m->regions[m->nregions++] = (BarRegion){x, ClkLtSymbol, 0};
+	if (m->b.width - tw > x)
+		m->regions[m->nregions++] = (BarRegion){m->b.width - tw, ClkTitle, 0};
+	if (tw)
+		m->regions[m->nregions++] = (BarRegion){m->b.width, ClkStatus, 0};
 
 	if ((w = m->b.width - tw - x) > m->b.height) {
 		if (c) {
@@ -2028,7 +3034,7 @@ focusclient(Client *c, int lift)
 
 	/* Raise client in stacking order if requested */
 	if (c && lift)
-		wlr_scene_node_raise_to_top(&c->scene->node);
+		raiseclient(c);
 
 	if (c && client_surface(c) == old)
 		return;
@@ -2047,6 +3053,10 @@ focusclient(Client *c, int lift)
 		c->isurgent = 0;
 		client_restack_surface(c);
 
+		/* The layout kept it out of sight, bring it up */
+		if (c->occluded)
+			arrange(c->mon);
+
 		/* Don't change border color if there is an exclusive focus or we are
 		 * handling a drag operation */
 		if (!exclusive_focus && !seat->drag)
@@ -2088,6 +3098,7 @@ focusclient(Client *c, int lift)
 
 	/* Activate the new client */
 	client_activate_surface(client_surface(c), 1);
+	updateweights();
 }
 
 void
@@ -2142,6 +3153,94 @@ focustop(Monitor *m)
 	return NULL;
 }
 
+int
+fpstimeout(void *data)
+{
+	Monitor *m = data;
+	m->fps_due = 0;
+	wlr_output_schedule_frame(m->wlr_output);
+	return 0;
+}
+
+void
+freezeclient(Client *c, int freeze)
+{
+	Client *w;
+	pid_t pgid;
+
+	if (c->pid <= 0)
+		return;
+	/* Stop the whole process group, unless it is dwl's own */
+	pgid = getpgid(c->pid);
+	if (pgid > 0 && pgid != getpgrp())
+		kill(-pgid, freeze ? SIGSTOP : SIGCONT);
+	else
+		kill(c->pid, freeze ? SIGSTOP : SIGCONT);
+
+	wl_list_for_each(w, &clients, link) {
+		if (w == c || (w->pid > 0 && (w->pid == c->pid
+				|| (pgid > 0 && getpgid(w->pid) == pgid)))) {
+			w->frozen = freeze;
+			setstopped(w, freeze);
+		}
+	}
+}
+
+int
+freezeclients(void *data)
+{
+	Client *c, *w;
+	int64_t now = monotonicmsec(), next = 0, due;
+	pid_t pgid;
+
+	freeze_armed = 0;
+	wl_list_for_each(c, &clients, link) {
+		if (!c->freezehidden || c->frozen || !c->hidden_since || c->pid <= 0)
+			continue;
+		due = c->hidden_since + freeze_timeout * 1000;
+		if (now < due) {
+			if (!next || due < next)
+				next = due;
+			continue;
+		}
+
+		/* Other windows of the same processes have to be parked too */
+		pgid = getpgid(c->pid);
+		wl_list_for_each(w, &clients, link) {
+			if (w != c && w->pid > 0 && (w->pid == c->pid
+					|| (pgid > 0 && getpgid(w->pid) == pgid))
+					&& (!w->freezehidden || !w->hidden_since
+						|| now < w->hidden_since + freeze_timeout * 1000))
+				break;
+		}
+		if (&w->link == &clients)
+			freezeclient(c, 1);
+	}
+
+	if (next) {
+		freeze_armed = 1;
+		wl_event_source_timer_update(freeze_source, (int)MAX(1, next - now));
+	}
+	return 0;
+}
+
+void
+freezevisibility(struct wl_listener *listener, void *data)
+{
+	Client *c = data;
+
+	/* Start the freeze_timeout countdown once it leaves the screen */
+	if (c->visibility != VisHidden) {
+		c->hidden_since = 0;
+	} else if (!c->hidden_since) {
+		c->hidden_since = monotonicmsec();
+		if (c->freezehidden && !freeze_armed) {
+			freeze_armed = 1;
+			wl_event_source_timer_update(freeze_source, freeze_timeout * 1000);
+		}
+	}
+}
+
 void
 fullscreennotify(struct wl_listener *listener, void *data)
 {
@@ -2178,6 +3277,10 @@ handlesig(int signo)
 {
 	if (signo == SIGCHLD) {
 		siginfo_t in;
+		/* Stops and continues are sorted out in the event loop */
+		if (sig_pipe[1] >= 0 && write(sig_pipe[1], &(char){SIGCHLD}, 1) < 0) {
+			/* The pipe is full, signalnotify() runs anyway */
+		}
 		/* wlroots expects to reap the XWayland process itself, so we
 		 * use WNOWAIT to keep the child waitable until we know it's not
 		 * XWayland.
@@ -2188,6 +3291,7 @@ handlesig(int signo)
 #endif
 			   ) {
 			pid_t *p, *lim;
+			/* Its cgroup leaf is dropped by cgroupsweep() */
 			waitpid(in.si_pid, NULL, 0);
 			if (in.si_pid == child_pid)
 				child_pid = -1;
@@ -2204,6 +3308,10 @@ handlesig(int signo)
 		}
 	} else if (signo == SIGINT || signo == SIGTERM) {
 		quit(NULL);
+	} else if (signo == SIGUSR1) {
+		if (sig_pipe[1] >= 0 && write(sig_pipe[1], &(char){SIGUSR1}, 1) < 0) {
+			/* The pipe is full, a dump is pending anyway */
+		}
 	}
 }
 
@@ -2267,12 +3375,18 @@ swallow(Client *c, Client *w)
 void
 handlecursoractivity(void)
 {
-	wl_event_source_timer_update(hide_source, cursor_timeout * 1000);
+	/* The timer is only moved once it expires, see hidecursor() */
+	cursor_activity = monotonicmsec();
+	if (!hide_armed && cursor_timeout) {
+		hide_armed = 1;
+		wl_event_source_timer_update(hide_source, cursor_timeout * 1000);
+	}
 
 	if (!cursor_hidden)
 		return;
 
 	cursor_hidden = false;
+	cursor_default = 0;
 
 	if (last_cursor.shape)
 		wlr_cursor_set_xcursor(cursor, cursor_mgr,
@@ -2285,11 +3399,67 @@ handlecursoractivity(void)
 int
 hidecursor(void *data)
 {
+	int64_t idle = monotonicmsec() - cursor_activity;
+
+	hide_armed = 0;
+	if (idle < cursor_timeout * 1000) {
+		hide_armed = 1;
+		wl_event_source_timer_update(hide_source, (int)(cursor_timeout * 1000 - idle));
+		return 1;
+	}
+
 	wlr_cursor_unset_image(cursor);
 	cursor_hidden = true;
+	cursor_default = 0;
 	return 1;
 }
 
+void
+histadd(Histogram *h, int64_t usec)
+{
+	size_t i = usec > 0 ? (size_t)(usec / HIST_BUCKET) : 0;
+	h->count[MIN(i, LENGTH(h->count) - 1)]++;
+	h->samples++;
+}
+
+uint32_t
+histpercentile(const Histogram *h, unsigned int pct)
+{
+	/* Upper edge of the bucket holding the percentile, in usec */
+	uint64_t rank = ((uint64_t)h->samples * pct + 99) / 100, seen = 0;
+	size_t i;
+	for (i = 0; rank && i < LENGTH(h->count); i++)
+		if ((seen += h->count[i]) >= rank)
+			return (uint32_t)((i + 1) * HIST_BUCKET);
+	return 0;
+}
+
+void
+hitdestroy(struct wl_listener *listener, void *data)
+{
+	invalidatehit();
+}
+
+void
+idleactivity(void)
+{
+	int64_t now = monotonicmsec();
+
+	/* Idle timeouts are far longer than the interval between pointer
+	 * events, they need not be reset by every one of them */
+	if (now - idle_notified < idle_interval)
+		return;
+	idle_notified = now;
+	wlr_idle_notifier_v1_notify_activity(idle_notifier, seat);
+}
+
+void
+idlevisibility(struct wl_listener *listener, void *data)
+{
+	if (!wl_list_empty(&idle_inhibit_mgr->inhibitors))
+		checkidleinhibitor(NULL);
+}
+
 void
 incnmaster(const Arg *arg)
 {
@@ -2329,25 +3499,65 @@ inputdevice(struct wl_listener *listener, void *data)
 	wlr_seat_set_capabilities(seat, caps);
 }
 
+void
+invalidatehit(void)
+{
+	if (hitcache.node)
+		wl_list_remove(&hitcache.destroy.link);
+	hitcache.node = NULL;
+}
+
+void
+joinlayout(Client *c)
+{
+	Monitor *m = c->mon;
+
+	/* Keep showing what the client last drew until it has caught up with
+	 * the new layout, see commitlayout() */
+	if (!c->snapshot) {
+		c->snapshot = wlr_scene_tree_create(c->scene);
+		c->snapshot->node.data = c;
+		wlr_scene_node_for_each_buffer(&c->scene_surface->node,
+				snapshotbuffer, c->snapshot);
+		wlr_scene_node_set_enabled(&c->scene_surface->node, 0);
+		occlusion_dirty = 1;
+	}
+
+	if (!m->layout_txn) {
+		m->layout_txn = 1;
+		wl_event_source_timer_update(m->layout_txn_timer,
+				(int)MAX(1, c->resize_deadline - monotonicmsec()));
+	}
+}
+
 int
-keybinding(uint32_t mods, xkb_keycode_t keycode)
+keybinding(KeyboardGroup *group, uint32_t mods, xkb_keycode_t keycode)
 {
 	/*
 	 * Here we handle compositor keybindings. This is when the compositor is
 	 * processing keys, rather than passing them on to the client for its own
 	 * processing.
 	 */
-	const Key *k;
-	for (k = keys; k < END(keys); k++) {
-		if (CLEANMASK(mods) == CLEANMASK(k->mod)
-				&& keycode == k->keycode && k->func) {
-			k->func(&k->arg);
+	const Key **k, **end;
+	if (keycode > group->maxbinding)
+		return 0;
+	end = group->bindings + group->bindstart[keycode + 1];
+	for (k = group->bindings + group->bindstart[keycode]; k < end; k++) {
+		if (CLEANMASK(mods) == CLEANMASK((*k)->mod)) {
+			(*k)->func(&(*k)->arg);
 			return 1;
 		}
 	}
 	return 0;
 }
 
+void
+keymapnotify(struct wl_listener *listener, void *data)
+{
+	KeyboardGroup *group = wl_container_of(listener, group, keymap);
+	bindkeys(group);
+}
+
 void
 keypress(struct wl_listener *listener, void *data)
 {
@@ -2366,7 +3576,7 @@ keypress(struct wl_listener *listener, void *data)
 	/* On _press_ if there is no active screen locker,
 	 * attempt to process a compositor keybinding. */
 	if (!locked && event->state == WL_KEYBOARD_KEY_STATE_PRESSED)
-		handled = keybinding(mods, keycode);
+		handled = keybinding(group, mods, keycode);
 
 	if (handled && group->wlr_group->keyboard.repeat_info.delay > 0) {
 		group->mods = mods;
@@ -2381,6 +3591,8 @@ keypress(struct wl_listener *listener, void *data)
 	if (handled)
 		return;
 
+	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED)
+		latencyinput(seat->keyboard_state.focused_surface);
 	wlr_seat_set_keyboard(seat, &group->wlr_group->keyboard);
 	/* Pass unhandled keycodes along to the client. */
 	wlr_seat_keyboard_notify_key(seat, event->time_msec,
@@ -2410,7 +3622,7 @@ keyrepeat(void *data)
 	wl_event_source_timer_update(group->key_repeat_source,
 			1000 / group->wlr_group->keyboard.repeat_info.rate);
 
-	keybinding(group->mods, group->keycode);
+	keybinding(group, group->mods, group->keycode);
 
 	return 0;
 }
@@ -2423,11 +3635,64 @@ killclient(const Arg *arg)
 		client_send_close(sel);
 }
 
+void
+latencycommit(struct wlr_surface *surface)
+{
+	if (latency_probe.input && monotonicusec() - latency_probe.input >= PROBE_TIMEOUT)
+		latency_probe.input = 0;
+	if (latency_probe.input && !latency_probe.committed
+			&& surface == latency_probe.surface) {
+		latency_probe.committed = 1;
+		latency_probe.seq = latency_probe.mon->wlr_output->commit_seq;
+	}
+}
+
+void
+latencyinput(struct wlr_surface *surface)
+{
+	/* Follow the first input since the last measurement to the next commit
+	 * of the surface receiving it, presentmon() takes it from there. Input
+	 * that never changes anything is dropped after a second. */
+	int64_t now = monotonicusec();
+	Client *c = NULL;
+	LayerSurface *l = NULL;
+
+	if (latency_probe.input && now - latency_probe.input < PROBE_TIMEOUT)
+		return;
+	latency_probe.input = 0;
+	if (!surface || toplevel_from_wlr_surface(surface, &c, &l) < 0)
+		return;
+	if (l && l->mon) {
+		latency_probe.surface = l->layer_surface->surface;
+		latency_probe.mon = l->mon;
+	} else if (c && c->mon && !client_is_x11(c)) {
+		/* X11 surfaces are not followed to their commits */
+		latency_probe.surface = client_surface(c);
+		latency_probe.mon = c->mon;
+	} else {
+		return;
+	}
+	latency_probe.input = now;
+	latency_probe.committed = 0;
+}
+
+int
+layouttimeout(void *data)
+{
+	Monitor *m = data;
+
+	/* A deadline passed, rendermon() sorts out who is late */
+	m->layout_txn_late = 1;
+	wlr_output_schedule_frame(m->wlr_output);
+	return 0;
+}
+
 void
 locksession(struct wl_listener *listener, void *data)
 {
 	struct wlr_session_lock_v1 *session_lock = data;
 	SessionLock *lock;
+	invalidatehit();
 	wlr_scene_node_set_enabled(&locked_bg->node, 1);
 	if (cur_lock) {
 		wlr_session_lock_v1_destroy(session_lock);
@@ -2454,10 +3719,10 @@ mapnotify(struct wl_listener *listener, void *data)
 	Client *p = NULL;
 	Client *w, *c = wl_container_of(listener, c, map);
 	Monitor *m;
-	int i;
 
 	/* Create scene tree for this client and its border */
 	c->scene = client_surface(c)->data = wlr_scene_tree_create(layers[LyrTile]);
+	c->layer = LyrTile;
 	wlr_scene_node_set_enabled(&c->scene->node, c->type != XDGShell);
 	c->scene_surface = c->type == XDGShell
 			? wlr_scene_xdg_surface_create(c->scene, c->surface.xdg)
@@ -2469,7 +3734,7 @@ mapnotify(struct wl_listener *listener, void *data)
 	/* Handle unmanaged clients first so we can return prior create borders */
 	if (client_is_unmanaged(c)) {
 		/* Unmanaged clients always are floating */
-		wlr_scene_node_reparent(&c->scene->node, layers[LyrFloat]);
+		setlayer(c, LyrFloat);
 		wlr_scene_node_set_position(&c->scene->node, c->geom.x, c->geom.y);
 		if (client_wants_focus(c)) {
 			focusclient(c, 1);
@@ -2478,11 +3743,12 @@ mapnotify(struct wl_listener *listener, void *data)
 		goto unset_fullscreen;
 	}
 
-	for (i = 0; i < 4; i++) {
-		c->border[i] = wlr_scene_rect_create(c->scene, 0, 0,
-			(float[])COLOR(colors[c->isurgent ? SchemeUrg : SchemeNorm][ColBorder]));
-		c->border[i]->node.data = c;
-	}
+	/* The other sides are only created once they are needed */
+	c->border[0] = wlr_scene_rect_create(c->scene, 0, 0,
+		(float[])COLOR(colors[c->isurgent ? SchemeUrg : SchemeNorm][ColBorder]));
+	c->border[0]->node.data = c;
+	wlr_scene_node_lower_to_bottom(&c->border[0]->node);
+	c->solidborder = 1;
 
 	/* Initialize client geometry with room for border */
 	client_set_tiled(c, WLR_EDGE_TOP | WLR_EDGE_BOTTOM | WLR_EDGE_LEFT | WLR_EDGE_RIGHT);
@@ -2537,19 +3803,48 @@ maximizenotify(struct wl_listener *listener, void *data)
 void
 monocle(Monitor *m)
 {
-	Client *c;
+	Client *c, *top = NULL;
 	int n = 0;
 
+	/* Only the top of the stack is shown and configured, the others are
+	 * occluded until they are focused */
+	wl_list_for_each(c, &fstack, flink) {
+		if (VISIBLEON(c, m) && !c->isfloating && !c->isfullscreen) {
+			top = c;
+			break;
+		}
+	}
 	wl_list_for_each(c, &clients, link) {
 		if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen)
 			continue;
-		resize(c, m->w, 0);
+		if (c == top)
+			resize(c, m->w, 0);
+		else
+			c->occluded = 1;
 		n++;
 	}
 	if (n)
 		snprintf(m->ltsymbol, LENGTH(m->ltsymbol), "[%d]", n);
-	if ((c = focustop(m)))
-		wlr_scene_node_raise_to_top(&c->scene->node);
+	/* c has no scene yet while predictgeom() lays it out, and the clients
+	 * of a hidden tag are not restacked while prelayout() sizes them */
+	if (!prelayout_running && (c = focustop(m)) && c->scene)
+		raiseclient(c);
+}
+
+int64_t
+monotonicmsec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int64_t
+monotonicusec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 void
@@ -2577,119 +3872,43 @@ void
 motionnotify(uint32_t time, struct wlr_input_device *device, double dx, double dy,
 		double dx_unaccel, double dy_unaccel)
 {
-	int tiled = 0;
-	double sx = 0, sy = 0, sx_confined, sy_confined, dx_total, dy_total;
-	Client *c = NULL, *w = NULL;
-	LayerSurface *l = NULL;
-	struct wlr_surface *surface = NULL;
-	struct wlr_pointer_constraint_v1 *constraint;
-
-	/* Find the client under the pointer and send the event along. */
-	xytonode(cursor->x, cursor->y, &surface, &c, NULL, &sx, &sy);
-
-	if (cursor_mode == CurPressed && !seat->drag
-			&& surface != seat->pointer_state.focused_surface
-			&& toplevel_from_wlr_surface(seat->pointer_state.focused_surface, &w, &l) >= 0) {
-		c = w;
-		surface = seat->pointer_state.focused_surface;
-		sx = cursor->x - (l ? l->geom.x : w->geom.x);
-		sy = cursor->y - (l ? l->geom.y : w->geom.y);
-	}
+	double sx, sy, sx_confined, sy_confined;
+	Client *c = NULL;
 
 	/* time is 0 in internal calls meant to restore pointer focus. */
-	if (time) {
-		wlr_relative_pointer_manager_v1_send_relative_motion(
-				relative_pointer_mgr, seat, (uint64_t)time * 1000,
-				dx, dy, dx_unaccel, dy_unaccel);
-
-		wl_list_for_each(constraint, &pointer_constraints->constraints, link)
-			cursorconstrain(constraint);
-
-		if (active_constraint && cursor_mode != CurResize && cursor_mode != CurMove) {
-			toplevel_from_wlr_surface(active_constraint->surface, &c, NULL);
-			if (c && active_constraint->surface == seat->pointer_state.focused_surface) {
-				sx = cursor->x - c->geom.x - c->bw;
-				sy = cursor->y - c->geom.y - c->bw;
-				if (wlr_region_confine(&active_constraint->region, sx, sy,
-						sx + dx, sy + dy, &sx_confined, &sy_confined)) {
-					dx = sx_confined - sx;
-					dy = sy_confined - sy;
-				}
-
-				if (active_constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED)
-					return;
-			}
-		}
-
-		wlr_cursor_move(cursor, device, dx, dy);
-		wlr_idle_notifier_v1_notify_activity(idle_notifier, seat);
-		handlecursoractivity();
-
-		/* Update selmon (even while dragging a window) */
-		if (sloppyfocus)
-			selmon = xytomon(cursor->x, cursor->y);
+	if (!time) {
+		pointermotion(0);
+		return;
 	}
 
-	/* Update drag icon's position */
-	wlr_scene_node_set_position(&drag_icon->node, (int)round(cursor->x), (int)round(cursor->y));
-
-	/* Skip if internal call or already resizing */
-	if (time == 0 && resizing_from_mouse)
-		goto focus;
-
-	tiled = grabc && !grabc->isfloating && !grabc->isfullscreen;
-	if (cursor_mode == CurMove) {
-		/* Move the grabbed client to the new position. */
-		if (grabc && grabc->isfloating) {
-			resize(grabc, (struct wlr_box){
-				.x = (int)round(cursor->x) - grabcx,
-				.y = (int)round(cursor->y) - grabcy,
-				.width = grabc->geom.width,
-				.height = grabc->geom.height
-			}, 1);
-			return;
-		}
-	} else if (cursor_mode == CurResize) {
-		if (tiled && resizing_from_mouse) {
-			dx_total = cursor->x - resize_last_update_x;
-			dy_total = cursor->y - resize_last_update_y;
-
-			if (time - last_resize_time >= resize_interval_ms) {
-				Arg a = {0};
-				if (fabs(dx_total) > fabs(dy_total)) {
-					a.f = (float)(dx_total * resize_factor);
-					setratio_h(&a);
-				} else {
-					a.f = (float)(dy_total * resize_factor);
-					setratio_v(&a);
-				}
-				arrange(selmon);
-
-				last_resize_time = time;
-				resize_last_update_x = cursor->x;
-				resize_last_update_y = cursor->y;
+	/* Every event reaches the clients as relative motion and moves the
+	 * cursor, the rest is done once per input frame, see cursorframe() */
+	wlr_relative_pointer_manager_v1_send_relative_motion(
+			relative_pointer_mgr, seat, (uint64_t)time * 1000,
+			dx, dy, dx_unaccel, dy_unaccel);
+
+	/* A constraint created since the last motion applies to this one */
+	checkconstraint();
+	if (active_constraint && cursor_mode != CurResize && cursor_mode != CurMove) {
+		toplevel_from_wlr_surface(active_constraint->surface, &c, NULL);
+		if (c && active_constraint->surface == seat->pointer_state.focused_surface) {
+			sx = cursor->x - c->geom.x - c->bw;
+			sy = cursor->y - c->geom.y - c->bw;
+			if (wlr_region_confine(&active_constraint->region, sx, sy,
+					sx + dx, sy + dy, &sx_confined, &sy_confined)) {
+				dx = sx_confined - sx;
+				dy = sy_confined - sy;
 			}
 
-		} else if (grabc && grabc->isfloating) {
-			/* Floating resize as original */
-			resize(grabc, (struct wlr_box){
-				.x = grabc->geom.x,
-				.y = grabc->geom.y,
-				.width = (int)round(cursor->x) - grabc->geom.x,
-				.height = (int)round(cursor->y) - grabc->geom.y
-			}, 1);
-			return;
+			if (active_constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED)
+				return;
 		}
 	}
 
-focus:
-	/* If there's no client surface under the cursor, set the cursor image to a
-	 * default. This is what makes the cursor image appear when you move it
-	 * off of a client or over its border. */
-	if (!surface && !seat->drag && !cursor_hidden)
-		wlr_cursor_set_xcursor(cursor, cursor_mgr, "default");
-
-	pointerfocus(c, surface, sx, sy, time);
+	wlr_cursor_move(cursor, device, dx, dy);
+	motion_time = time;
+	motion_pending = 1;
+	latencyinput(seat->pointer_state.focused_surface);
 }
 
 void
@@ -2718,6 +3937,7 @@ moveresize(const Arg *arg)
 
 	cursor_mode = arg->ui;
 	grabc->was_tiled = (!grabc->isfloating && !grabc->isfullscreen);
+	cursor_default = 0;
 
 	if (grabc->was_tiled) {
 		switch (cursor_mode) {
@@ -2731,6 +3951,7 @@ moveresize(const Arg *arg)
 			wlr_cursor_set_xcursor(cursor, cursor_mgr, "se-resize");
 			resize_last_update_x = cursor->x;
 			resize_last_update_y = cursor->y;
+			resize_motion_pending = 0;
 			resizing_from_mouse = 1;
 			break;
 		}
@@ -2755,17 +3976,59 @@ moveresize(const Arg *arg)
 }
 
 void
-outputmgrapply(struct wl_listener *listener, void *data)
+occludeclient(Client *c, pixman_region32_t *covered)
 {
-	struct wlr_output_configuration_v1 *config = data;
-	outputmgrapplyortest(config, 0);
-}
+	pixman_region32_t opaque;
+	struct wlr_box clip;
+	int hidden, overlap;
 
-void
-outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test)
-{
-	/*
-	 * Called when a client such as wlr-randr requests a change in output
+	if (client_is_unmanaged(c))
+		return;
+	if (!c->mon || !VISIBLEON(c, c->mon) || c->occluded) {
+		c->covered = c->overlapped = 0;
+		updatevisibility(c);
+		return;
+	}
+
+	overlap = pixman_region32_contains_rectangle(covered, &(pixman_box32_t){
+			c->geom.x, c->geom.y, c->geom.x + c->geom.width,
+			c->geom.y + c->geom.height});
+	hidden = overlap == PIXMAN_REGION_IN;
+	c->overlapped = overlap == PIXMAN_REGION_PART;
+	if (hidden != c->covered) {
+		c->covered = hidden;
+		wlr_scene_node_set_enabled(&c->scene->node, !hidden);
+		client_set_suspended(c, hidden);
+	}
+	updatevisibility(c);
+	/* Neither a translucent surface nor a snapshot, which may not match
+	 * the surface's opaque region, hides anything */
+	if (hidden || c->translucent || c->snapshot)
+		return;
+
+	/* The opaque part of the surface, as clipped by resizescene() */
+	client_get_clip(c, &clip);
+	pixman_region32_init(&opaque);
+	pixman_region32_intersect_rect(&opaque, &client_surface(c)->opaque_region,
+			clip.x, clip.y, clip.width, clip.height);
+	pixman_region32_translate(&opaque,
+			c->geom.x + c->bw - clip.x, c->geom.y + c->bw - clip.y);
+	pixman_region32_union(covered, covered, &opaque);
+	pixman_region32_fini(&opaque);
+}
+
+void
+outputmgrapply(struct wl_listener *listener, void *data)
+{
+	struct wlr_output_configuration_v1 *config = data;
+	outputmgrapplyortest(config, 0);
+}
+
+void
+outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test)
+{
+	/*
+	 * Called when a client such as wlr-randr requests a change in output
 	 * configuration. This is only one way that the layout can be changed,
 	 * so any Monitor information should be updated by updatemons() after an
 	 * output_layout.change event, not here.
@@ -2849,6 +4112,7 @@ pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 	/* If surface is NULL, clear pointer focus */
 	if (!surface) {
 		wlr_seat_pointer_notify_clear_focus(seat);
+		checkconstraint();
 		return;
 	}
 
@@ -2862,6 +4126,253 @@ pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 	 * wlroots makes this a no-op if surface is already focused */
 	wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
 	wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+	checkconstraint();
+}
+
+void
+pointermotion(uint32_t time)
+{
+	int tiled = 0;
+	double sx = 0, sy = 0;
+	Client *c = NULL, *w = NULL;
+	LayerSurface *l = NULL;
+	struct wlr_surface *surface = NULL;
+
+	motion_pending = 0;
+
+	/* Find the client under the pointer and send the event along. */
+	xytonode(cursor->x, cursor->y, &surface, &c, NULL, &sx, &sy);
+
+	if (cursor_mode == CurPressed && !seat->drag
+			&& surface != seat->pointer_state.focused_surface
+			&& toplevel_from_wlr_surface(seat->pointer_state.focused_surface, &w, &l) >= 0) {
+		c = w;
+		surface = seat->pointer_state.focused_surface;
+		sx = cursor->x - (l ? l->geom.x : w->geom.x);
+		sy = cursor->y - (l ? l->geom.y : w->geom.y);
+	}
+
+	if (time) {
+		idleactivity();
+		handlecursoractivity();
+
+		/* Update selmon (even while dragging a window) */
+		if (sloppyfocus)
+			selmon = xytomon(cursor->x, cursor->y);
+	}
+
+	/* Update drag icon's position */
+	if (seat->drag)
+		wlr_scene_node_set_position(&drag_icon->node, (int)round(cursor->x), (int)round(cursor->y));
+
+	/* Skip if internal call or already resizing */
+	if (time == 0 && resizing_from_mouse)
+		goto focus;
+
+	tiled = grabc && !grabc->isfloating && !grabc->isfullscreen;
+	if (cursor_mode == CurMove) {
+		/* Move the grabbed client to the new position. */
+		if (grabc && grabc->isfloating) {
+			resize(grabc, (struct wlr_box){
+				.x = (int)round(cursor->x) - grabcx,
+				.y = (int)round(cursor->y) - grabcy,
+				.width = grabc->geom.width,
+				.height = grabc->geom.height
+			}, 1);
+			return;
+		}
+	} else if (cursor_mode == CurResize) {
+		if (tiled && resizing_from_mouse) {
+			/* Applied on the next frame of this output, see rendermon() */
+			resize_motion_pending = 1;
+			wlr_output_schedule_frame(selmon->wlr_output);
+		} else if (grabc && grabc->isfloating) {
+			/* Floating resize as original */
+			resize(grabc, (struct wlr_box){
+				.x = grabc->geom.x,
+				.y = grabc->geom.y,
+				.width = (int)round(cursor->x) - grabc->geom.x,
+				.height = (int)round(cursor->y) - grabc->geom.y
+			}, 1);
+			return;
+		}
+	}
+
+focus:
+	/* If there's no client surface under the cursor, set the cursor image to a
+	 * default. This is what makes the cursor image appear when you move it
+	 * off of a client or over its border. */
+	if (!surface && !seat->drag && !cursor_hidden && !cursor_default) {
+		wlr_cursor_set_xcursor(cursor, cursor_mgr, "default");
+		cursor_default = 1;
+	}
+
+	pointerfocus(c, surface, sx, sy, time);
+}
+
+int
+pollstopped(void *data)
+{
+	Client *c;
+
+	stopped_armed = 0;
+	wl_list_for_each(c, &clients, link) {
+		if (c->pid <= 0 || c->ischild || client_is_x11(c))
+			continue;
+		setstopped(c, procstopped(c->pid));
+		stopped_armed = 1;
+	}
+
+	if (stopped_armed)
+		wl_event_source_timer_update(stopped_source, stopped_interval);
+	return 0;
+}
+
+int
+predictgeom(Client *c, struct wlr_box *geom)
+{
+	Monitor *m = c->mon;
+	Client *w;
+	struct {
+		struct wlr_box geom;
+		int occluded;
+	} *saved;
+	size_t i = 0;
+
+	if (!m || c->isfloating || c->isfullscreen || !VISIBLEON(c, m)
+			|| !m->lt[m->sellt]->arrange || client_get_parent(c))
+		return 0;
+
+	/* Run the layout as if c was already mapped, without applying anything,
+	 * then put everything back the way it was */
+	saved = ecalloc(wl_list_length(&clients) + 1, sizeof(*saved));
+	wl_list_for_each(w, &clients, link) {
+		saved[i].geom = w->geom;
+		saved[i++].occluded = w->occluded;
+	}
+
+	wl_list_insert(&clients, &c->link);
+	wl_list_insert(&fstack, &c->flink);
+	resize = resizenoapply;
+	arrangelayout(m);
+	resize = resizeapply;
+	wl_list_remove(&c->link);
+	wl_list_remove(&c->flink);
+	remove_client(m, c);
+
+	i = 0;
+	wl_list_for_each(w, &clients, link) {
+		w->geom = saved[i].geom;
+		w->occluded = saved[i++].occluded;
+	}
+	free(saved);
+
+	*geom = c->geom;
+	return geom->width > 2 * (int)c->bw && geom->height > 2 * (int)c->bw;
+}
+
+void
+prelayout(void *data)
+{
+	Monitor *m = data;
+	Client *c;
+	uint32_t tagset = m->tagset[m->seltags], shown = 0, hidden = 0;
+	unsigned int i, sellt = m->sellt;
+	const Layout *lt[2] = {m->lt[0], m->lt[1]};
+	int nmaster = m->nmaster;
+	float mfact = m->mfact;
+	char ltsymbol[LENGTH(m->ltsymbol)];
+
+	m->prelayout_idle = NULL;
+	if (!m->wlr_output->enabled)
+		return;
+
+	/* Send the clients of each hidden tag the size they will get once the
+	 * tag is viewed, so that switching to it needs no new configure. Tags
+	 * sharing a tiled client with the visible ones are left alone, laying
+	 * them out would move it on screen. */
+	wl_list_for_each(c, &clients, link) {
+		if (c->mon != m || c->isfloating || c->isfullscreen)
+			continue;
+		if (c->tags & tagset)
+			shown |= c->tags;
+		else
+			hidden |= c->tags;
+	}
+	hidden &= ~shown & TAGMASK;
+
+	/* Layouts may write their symbol, monocle() does */
+	memcpy(ltsymbol, m->ltsymbol, sizeof(ltsymbol));
+	prelayout_hidden = hidden;
+	resize = resizeprelayout;
+	for (i = 0; i < TAGCOUNT; i++) {
+		if (!(hidden & 1u << i))
+			continue;
+		prelayout_running = 1u << i;
+		m->tagset[m->seltags] = 1u << i;
+		m->sellt = m->pertag->sellts[i + 1];
+		m->lt[0] = m->pertag->ltidxs[i + 1][0];
+		m->lt[1] = m->pertag->ltidxs[i + 1][1];
+		m->nmaster = m->pertag->nmasters[i + 1];
+		m->mfact = m->pertag->mfacts[i + 1];
+		arrangelayout(m);
+	}
+	prelayout_running = 0;
+	resize = resizeapply;
+
+	m->tagset[m->seltags] = tagset;
+	m->sellt = sellt;
+	m->lt[0] = lt[0];
+	m->lt[1] = lt[1];
+	m->nmaster = nmaster;
+	m->mfact = mfact;
+	memcpy(m->ltsymbol, ltsymbol, sizeof(ltsymbol));
+}
+
+void
+presentmon(struct wl_listener *listener, void *data)
+{
+	Monitor *m = wl_container_of(listener, m, present);
+	struct wlr_output_event_present *event = data;
+	int64_t when = 0;
+
+	if (event->presented && event->when) {
+		when = (int64_t)event->when->tv_sec * 1000000 + event->when->tv_nsec / 1000;
+		/* Gaps over two refresh periods are the output idling, not slow frames */
+		if (m->last_vblank && event->refresh > 0
+				&& (when - m->last_vblank) * 1000 <= 2 * (int64_t)event->refresh)
+			m->stats.interval[m->stats.presents++ % LENGTH(m->stats.interval)]
+					= (int)(when - m->last_vblank);
+		if (m->stats.committed && event->refresh > 0
+				&& (when - m->stats.committed) * 1000 > (int64_t)event->refresh * 3 / 2)
+			m->stats.missed++;
+		m->stats.committed = 0;
+		m->last_vblank = when;
+	}
+
+	/* A delayed frame shown within half a refresh of the vblank it was
+	 * composed for made it, otherwise it slipped to a later one */
+	if (m->frame_target && (int32_t)(event->commit_seq - m->frame_seq) >= 0) {
+		if (when && m->wlr_output->refresh > 0 && when - m->frame_target
+				< 500000000LL / m->wlr_output->refresh) {
+			m->framemisses = 0;
+		} else if (++m->framemisses >= 3) {
+			/* Composing right away still beats missing every other frame */
+			wlr_log(WLR_INFO, "%s missed %d frame deadlines in a row, not delaying frames for a while",
+					m->wlr_output->name, m->framemisses);
+			m->framemisses = 0;
+			m->framebackoff = 300;
+		}
+		m->frame_target = 0;
+	}
+
+	if (!latency_probe.input || !latency_probe.committed || latency_probe.mon != m
+			|| (int32_t)(event->commit_seq - latency_probe.seq) <= 0)
+		return;
+	if (event->presented && event->when
+			&& m->last_vblank - latency_probe.input < PROBE_TIMEOUT)
+		histadd(&m->latency, m->last_vblank - latency_probe.input);
+	latency_probe.input = 0;
 }
 
 void
@@ -2889,62 +4400,76 @@ powermgrsetmode(struct wl_listener *listener, void *data)
 	m->asleep = !event->mode;
 }
 
+int
+procstopped(pid_t pid)
+{
+	char path[64], buf[256], *p;
+	size_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	/* The state follows the command name, which may contain parentheses */
+	return (p = strrchr(buf, ')')) && (p[1] && (p[2] == 'T' || p[2] == 't'));
+}
+
 void
 quit(const Arg *arg)
 {
+	running = 0;
+	/* Wakes up runloop() */
 	wl_display_terminate(dpy);
 }
 
+void
+raiseclient(Client *c)
+{
+	invalidatehit();
+	occlusion_dirty = 1;
+	wlr_scene_node_raise_to_top(&c->scene->node);
+	/* Its tag goes above the other tags of the layer too, which only shows
+	 * while several tags are viewed */
+	if (c->scene->node.parent != layers[c->layer])
+		wlr_scene_node_raise_to_top(&c->scene->node.parent->node);
+}
+
 void
 rendermon(struct wl_listener *listener, void *data)
 {
 	/* This function is called every time an output is ready to display a frame,
 	 * generally at the output's refresh rate (e.g. 60Hz). */
 	Monitor *m = wl_container_of(listener, m, frame);
-	Client *c;
-	struct wlr_output_state pending = {0};
-	struct wlr_gamma_control_v1 *gamma_control;
-	struct timespec now;
-
-	/* Render if no XDG clients have an outstanding resize and are visible on
-	 * this monitor. */
-	wl_list_for_each(c, &clients, link) {
-		if (c->resize && !c->isfloating && client_is_rendered_on_mon(c, m) && !client_is_stopped(c))
-			goto skip;
-	}
-
-	/*
-	 * HACK: The "correct" way to set the gamma is to commit it together with
-	 * the rest of the state in one go, but to do that we would need to rewrite
-	 * wlr_scene_output_commit() in order to add the gamma to the pending
-	 * state before committing, instead try to commit the gamma in one frame,
-	 * and commit the rest of the state in the next one (or in the same frame if
-	 * the gamma can not be committed).
-	 */
-	if (m->gamma_lut_changed) {
-		gamma_control
-				= wlr_gamma_control_manager_v1_get_control(gamma_control_mgr, m->wlr_output);
-		m->gamma_lut_changed = 0;
+	int64_t now, period, vblank, start, cost = 0;
+	size_t i;
 
-		if (!wlr_gamma_control_v1_apply(gamma_control, &pending))
-			goto commit;
+	/* The frame is already waiting for frame_timer */
+	if (m->framedelayed)
+		return;
 
-		if (!wlr_output_test_state(m->wlr_output, &pending)) {
-			wlr_gamma_control_v1_send_failed_and_destroy(gamma_control);
-			goto commit;
+	/* Rather than right away, compose the frame as late as the recent
+	 * composition times allow, so clients committing meanwhile make it */
+	m->frame_deadline = 0;
+	if (m->framedelay && !m->framebackoff && m->last_vblank
+			&& m->wlr_output->refresh > 0) {
+		now = monotonicusec();
+		period = 1000000000LL / m->wlr_output->refresh;
+		vblank = m->last_vblank + ((now - m->last_vblank) / period + 1) * period;
+		for (i = 1; i <= 8 && i <= m->stats.frames; i++)
+			cost = MAX(cost, m->stats.compose[(m->stats.frames - i) % LENGTH(m->stats.compose)]);
+		start = vblank - cost - frame_margin * 1000;
+		if (start - now >= 1000) {
+			m->framedelayed = 1;
+			m->frame_deadline = vblank;
+			wl_event_source_timer_update(m->frame_timer, (int)((start - now) / 1000));
+			return;
 		}
-		wlr_output_commit_state(m->wlr_output, &pending);
-		wlr_output_schedule_frame(m->wlr_output);
-	} else {
-commit:
-		wlr_scene_output_commit(m->scene_output, NULL);
 	}
-
-skip:
-	/* Let clients know a frame has been rendered */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(m->scene_output, &now);
-	wlr_output_state_finish(&pending);
+	commitframe(m);
 }
 
 void
@@ -2980,7 +4505,7 @@ void
 resizeapply(Client *c, struct wlr_box geo, int interact)
 {
 	struct wlr_box *bbox;
-	struct wlr_box clip;
+	uint32_t serial;
 
 	if (!c->mon || !client_surface(c)->mapped)
 		return;
@@ -2991,29 +4516,109 @@ resizeapply(Client *c, struct wlr_box geo, int interact)
 	c->geom = geo;
 	applybounds(c, bbox);
 
+	/* this is a no-op if size hasn't changed */
+	serial = client_set_size(c, c->geom.width - 2 * c->bw,
+			c->geom.height - 2 * c->bw);
+	/* The client gets stall_frames refresh cycles from the first configure
+	 * it has not acked yet, see rendermon() */
+	if (serial && !c->resize)
+		resizedeadline(c);
+	c->resize = serial;
+	updatepending(c);
+
+	/* A visible tiled client has to redraw, it becomes part of the layout
+	 * transaction of its monitor and its scene is updated on commit. */
+	if (c->resize && !c->isfloating && (c->outputs & c->mon->bit)
+			&& !client_is_stopped(c))
+		joinlayout(c);
+	/* Tiled clients move together with the ones taking part in a layout
+	 * change, see commitlayout() */
+	if (!c->isfloating && VISIBLEON(c, c->mon)
+			&& (c->mon->arranging || c->mon->layout_txn))
+		c->scenepending = 1;
+	else if (!c->snapshot || !c->mon->layout_txn)
+		resizescene(c);
+}
+
+void
+resizedeadline(Client *c)
+{
+	int refresh = c->mon && c->mon->wlr_output->refresh
+			? c->mon->wlr_output->refresh : 60000;
+
+	c->resize_sent = monotonicmsec();
+	c->resize_deadline = c->resize_sent + stall_frames * 1000000 / refresh;
+}
+
+void
+resizenoapply(Client *c, struct wlr_box geo, int interact)
+{
+	c->geom = geo;
+	c->interact = interact;
+}
+
+void
+resizeprelayout(Client *c, struct wlr_box geo, int interact)
+{
+	uint32_t mask = c->tags & prelayout_hidden;
+
+	/* A client on several hidden tags is only sized for the lowest of them,
+	 * anything else would send it a configure per tag on every arrange */
+	if ((mask & -mask) == prelayout_running)
+		resizeapply(c, geo, interact);
+}
+
+void
+resizescene(Client *c)
+{
+	struct wlr_box clip;
+	int moved = c->snapshot || c->scene->node.x != c->geom.x
+			|| c->scene->node.y != c->geom.y;
+
+	c->scenepending = 0;
+	if (c->snapshot) {
+		wlr_scene_node_destroy(&c->snapshot->node);
+		c->snapshot = NULL;
+		wlr_scene_node_set_enabled(&c->scene_surface->node, 1);
+	}
+
 	/* Update scene-graph, including borders */
 	wlr_scene_node_set_position(&c->scene->node, c->geom.x, c->geom.y);
 	wlr_scene_node_set_position(&c->scene_surface->node, c->bw, c->bw);
-	wlr_scene_rect_set_size(c->border[0], c->geom.width, c->bw);
-	wlr_scene_rect_set_size(c->border[1], c->geom.width, c->bw);
-	wlr_scene_rect_set_size(c->border[2], c->bw, c->geom.height - 2 * c->bw);
-	wlr_scene_rect_set_size(c->border[3], c->bw, c->geom.height - 2 * c->bw);
-	wlr_scene_node_set_position(&c->border[1]->node, 0, c->geom.height - c->bw);
-	wlr_scene_node_set_position(&c->border[2]->node, 0, c->bw);
-	wlr_scene_node_set_position(&c->border[3]->node, c->geom.width - c->bw, c->bw);
+	updateborder(c);
 
-	/* this is a no-op if size hasn't changed */
-	c->resize = client_set_size(c, c->geom.width - 2 * c->bw,
-			c->geom.height - 2 * c->bw);
 	client_get_clip(c, &clip);
 	wlr_scene_subsurface_tree_set_clip(&c->scene_surface->node, &clip);
+	/* Commits usually come back with the geometry the client already had */
+	if (moved || !wlr_box_equal(&clip, &c->clip)) {
+		occlusion_dirty = 1;
+		invalidatehit();
+	}
+	c->clip = clip;
 }
 
 void
-resizenoapply(Client *c, struct wlr_box geo, int interact)
+resizevisibility(struct wl_listener *listener, void *data)
 {
-	c->geom = geo;
-	c->interact = interact;
+	updatepending(data);
+}
+
+int
+ringpercentile(const int *ring, unsigned int n, unsigned int pct)
+{
+	int sorted[128];
+	unsigned int i, j;
+	int v;
+
+	/* Insertion sort, the rings are small and only sorted on request */
+	n = MIN(n, LENGTH(sorted));
+	for (i = 0; i < n; i++) {
+		v = ring[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	return n ? sorted[(n - 1) * pct / 100] : 0;
 }
 
 void
@@ -3038,6 +4643,7 @@ run(char *startup_cmd)
 		if (child_pid == 0) {
 			close(STDIN_FILENO);
 			setsid();
+			cgroupenter();
 			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, NULL);
 			die("startup: execl:");
 		}
@@ -3056,13 +4662,110 @@ run(char *startup_cmd)
 	 * monitor when displayed here */
 	wlr_cursor_warp_closest(cursor, NULL, cursor->x, cursor->y);
 	wlr_cursor_set_xcursor(cursor, cursor_mgr, "default");
+	cursor_default = 1;
 	handlecursoractivity();
 
-	/* Run the Wayland event loop. This does not return until you exit the
+	/* Run the event loops. This does not return until you exit the
 	 * compositor. Starting the backend rigged up all of the necessary event
 	 * loop configuration to listen to libinput events, DRM events, generate
 	 * frame events at the refresh rate, and so on. */
-	wl_display_run(dpy);
+	runloop();
+}
+
+void
+runloop(void)
+{
+	/* Input devices and outputs are on input_loop, clients and everything
+	 * else on event_loop. Each turn dispatches input_loop first, then lets
+	 * clients have at most dispatch_budget ms before input is checked again,
+	 * so a client flooding us with requests can't hold up the keyboard. */
+	struct pollfd fds[] = {
+		{ .fd = wl_event_loop_get_fd(input_loop), .events = POLLIN },
+		{ .fd = wl_event_loop_get_fd(event_loop), .events = POLLIN },
+	};
+	int64_t start, checked, now;
+
+	running = 1;
+	while (running) {
+		/* Idle sources are not visible to poll() */
+		wl_event_loop_dispatch_idle(input_loop);
+		wl_event_loop_dispatch_idle(event_loop);
+		wl_display_flush_clients(dpy);
+		if (poll(fds, LENGTH(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+
+		wl_event_loop_dispatch(input_loop, 0);
+		/* Get key and pointer events out before the clients' turn */
+		wl_display_flush_clients(dpy);
+		start = checked = monotonicusec();
+		loop_stats.turns++;
+		while (running) {
+			wl_event_loop_dispatch(event_loop, 0);
+			if (poll(fds, LENGTH(fds), 0) <= 0)
+				break;
+			now = monotonicusec();
+			if (fds[0].revents) {
+				/* Became ready at some point since the last check. It
+				 * only cut anything short if clients had more for us. */
+				if (fds[1].revents) {
+					loop_stats.preempted++;
+					loop_stats.latency_total += now - checked;
+					loop_stats.latency_max = MAX(loop_stats.latency_max, now - checked);
+				}
+				break;
+			}
+			if (now - start >= dispatch_budget * 1000) {
+				loop_stats.exhausted++;
+				break;
+			}
+			checked = now;
+		}
+	}
+}
+
+void
+sendframedone(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+	Monitor *m = data;
+	struct wlr_scene_surface *scene_surface;
+	Client *c = NULL;
+	int64_t now = (int64_t)m->frame_time.tv_sec * 1000 + m->frame_time.tv_nsec / 1000000;
+	int64_t due;
+	int fps = 0;
+
+	/* Buffers shown on several outputs are handled by their primary one */
+	if (buffer->primary_output != m->scene_output)
+		return;
+
+	/* Withhold frame done from clients over their rule's rate cap. All the
+	 * buffers of a client get it in the same frame. */
+	if ((scene_surface = wlr_scene_surface_try_from_buffer(buffer))
+			&& toplevel_from_wlr_surface(scene_surface->surface, &c, NULL) >= 0
+			&& c && c->mon) {
+		if (client_surface(c) == seat->keyboard_state.focused_surface)
+			fps = 0;
+		else if (c->mon != selmon)
+			fps = c->othermonfps ? c->othermonfps : c->unfocusedfps;
+		else
+			fps = c->unfocusedfps;
+
+		if (fps > 0 && c->lastframe != now && now - c->lastframe < 1000 / fps) {
+			/* Nothing may damage the output until the client gets its
+			 * frame done, so make sure there is a frame when it's due */
+			due = c->lastframe + 1000 / fps;
+			if (!m->fps_due || due < m->fps_due) {
+				m->fps_due = due;
+				wl_event_source_timer_update(m->fps_timer,
+						(int)MAX(1, due - monotonicmsec()));
+			}
+			return;
+		}
+		c->lastframe = now;
+	}
+	wlr_scene_buffer_send_frame_done(buffer, &m->frame_time);
 }
 
 void
@@ -3086,9 +4789,11 @@ setcursor(struct wl_listener *listener, void *data)
 		last_cursor.hotspot_x = event->hotspot_x;
 		last_cursor.hotspot_y = event->hotspot_y;
 
-		if (!cursor_hidden)
+		if (!cursor_hidden) {
 			wlr_cursor_set_surface(cursor, event->surface,
 					event->hotspot_x, event->hotspot_y);
+			cursor_default = 0;
+		}
 	}
 }
 
@@ -3105,9 +4810,11 @@ setcursorshape(struct wl_listener *listener, void *data)
 		last_cursor.shape = event->shape;
 		last_cursor.surface = NULL;
 
-		if (!cursor_hidden)
+		if (!cursor_hidden) {
 			wlr_cursor_set_xcursor(cursor, cursor_mgr,
 					wlr_cursor_shape_v1_name(event->shape));
+			cursor_default = 0;
+		}
 	}
 }
 
@@ -3116,12 +4823,12 @@ setfloating(Client *c, int floating)
 {
 	Client *p = client_get_parent(c);
 	c->isfloating = floating;
+	updatepending(c);
 	/* If in floating layout do not change the client's layer */
 	if (!c->mon || !client_surface(c)->mapped || !c->mon->lt[c->mon->sellt]->arrange)
 		return;
-	wlr_scene_node_reparent(&c->scene->node, layers[c->isfullscreen ||
-			(p && p->isfullscreen) ? LyrFS
-			: c->isfloating ? LyrFloat : LyrTile]);
+	setlayer(c, c->isfullscreen || (p && p->isfullscreen) ? LyrFS
+			: c->isfloating ? LyrFloat : LyrTile);
 	arrange(c->mon);
   printstatus();
 	drawbars();
@@ -3135,8 +4842,7 @@ setfullscreen(Client *c, int fullscreen)
 		return;
 	c->bw = fullscreen ? 0 : borderpx;
 	client_set_fullscreen(c, fullscreen);
-	wlr_scene_node_reparent(&c->scene->node, layers[c->isfullscreen
-			? LyrFS : c->isfloating ? LyrFloat : LyrTile]);
+	setlayer(c, c->isfullscreen ? LyrFS : c->isfloating ? LyrFloat : LyrTile);
 
 	if (fullscreen) {
 		c->prev = c->geom;
@@ -3162,6 +4868,15 @@ setgamma(struct wl_listener *listener, void *data)
 	wlr_output_schedule_frame(m->wlr_output);
 }
 
+void
+setlayer(Client *c, int layer)
+{
+	/* Clients without a monitor sit directly in the layer */
+	c->layer = layer;
+	wlr_scene_node_reparent(&c->scene->node, c->mon
+			? c->mon->pertag->trees[layer][tagindex(c->tags)] : layers[layer]);
+}
+
 void
 setlayout(const Arg *arg)
 {
@@ -3201,6 +4916,7 @@ setmon(Client *c, Monitor *m, uint32_t newtags)
 		return;
 	c->mon = m;
 	c->prev = c->geom;
+	updatepending(c);
 
 	/* Scene graph sends surface leave/enter events on move and resize */
 	if (oldmon)
@@ -3237,29 +4953,55 @@ setsel(struct wl_listener *listener, void *data)
 	wlr_seat_set_selection(seat, event->source, event->serial);
 }
 
+void
+setstopped(Client *c, int stopped)
+{
+	if (c->stopped == stopped)
+		return;
+	c->stopped = stopped;
+
+	/* Give it a full stall budget for the configure it missed, and let a
+	 * layout transaction go on without it while it is stopped */
+	if (!stopped && c->resize)
+		resizedeadline(c);
+	updatepending(c);
+	if (c->mon && c->mon->layout_txn)
+		wlr_output_schedule_frame(c->mon->wlr_output);
+}
+
 void
 setup(void)
 {
-	int i, sig[] = {SIGCHLD, SIGINT, SIGTERM, SIGPIPE};
+	int i, sig[] = {SIGCHLD, SIGINT, SIGTERM, SIGPIPE, SIGUSR1};
 	struct sigaction sa = {.sa_flags = SA_RESTART, .sa_handler = handlesig};
 	sigemptyset(&sa.sa_mask);
 
+	if (pipe(sig_pipe) < 0)
+		die("pipe:");
+	for (i = 0; i < 2; i++) {
+		fcntl(sig_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sig_pipe[i], F_SETFL, O_NONBLOCK);
+	}
 	for (i = 0; i < (int)LENGTH(sig); i++)
 		sigaction(sig[i], &sa, NULL);
 
 
 	wlr_log_init(log_level, NULL);
+	cgroupinit();
 
 	/* The Wayland display is managed by libwayland. It handles accepting
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
 	dpy = wl_display_create();
 	event_loop = wl_display_get_event_loop(dpy);
+	/* The backend gets a loop of its own so runloop() can give it priority */
+	if (!(input_loop = wl_event_loop_create()))
+		die("couldn't create event loop");
 
 	/* The backend is a wlroots feature which abstracts the underlying input and
 	 * output hardware. The autocreate option will choose the most suitable
 	 * backend based on the current environment, such as opening an X11 window
 	 * if an X11 server is running. */
-	if (!(backend = wlr_backend_autocreate(event_loop, &session)))
+	if (!(backend = wlr_backend_autocreate(input_loop, &session)))
 		die("couldn't create backend");
 
 	/* Initialize the scene graph used to lay out windows */
@@ -3418,6 +5160,17 @@ setup(void)
 	hide_source = wl_event_loop_add_timer(wl_display_get_event_loop(dpy),
 			hidecursor, cursor);
 
+	freeze_source = wl_event_loop_add_timer(event_loop, freezeclients, NULL);
+
+	wl_event_loop_add_fd(event_loop, sig_pipe[0], WL_EVENT_READABLE,
+			signalnotify, NULL);
+	stopped_source = wl_event_loop_add_timer(event_loop, pollstopped, NULL);
+
+	wl_signal_init(&visibility_signal);
+	wl_signal_add(&visibility_signal, &idle_visibility);
+	wl_signal_add(&visibility_signal, &freeze_visibility);
+	wl_signal_add(&visibility_signal, &resize_visibility);
+
 	/*
 	 * Configures a seat, which is a single "seat" at which a user sits and
 	 * operates the computer. This conceptually includes up to one keyboard,
@@ -3439,12 +5192,13 @@ setup(void)
 
 	kb_group = createkeyboardgroup();
 	wl_list_init(&kb_group->destroy.link);
+	bindbuttons();
 
 	output_mgr = wlr_output_manager_v1_create(dpy);
 	LISTEN_STATIC(&output_mgr->events.apply, outputmgrapply);
 	LISTEN_STATIC(&output_mgr->events.test, outputmgrtest);
 
-	wl_global_create(dpy, &zdwl_ipc_manager_v2_interface, 2, NULL, dwl_ipc_manager_bind);
+	wl_global_create(dpy, &zdwl_ipc_manager_v2_interface, 4, NULL, dwl_ipc_manager_bind);
 	drwl_init();
 
 	status_event_source = wl_event_loop_add_fd(wl_display_get_event_loop(dpy),
@@ -3470,6 +5224,62 @@ setup(void)
 #endif
 }
 
+int
+signalnotify(int fd, uint32_t mask, void *data)
+{
+	char buf[64];
+	ssize_t n, i;
+	int chld = 0, usr1 = 0;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			chld |= buf[i] == SIGCHLD;
+			usr1 |= buf[i] == SIGUSR1;
+		}
+	}
+	if (chld)
+		childnotify();
+	/* Dump the statistics on SIGUSR1 */
+	if (usr1)
+		dumpstats();
+	return 0;
+}
+
+void
+snapshotbuffer(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+	struct wlr_scene_tree *snapshot = data;
+	struct wlr_scene_buffer *copy;
+
+	if (!buffer->buffer)
+		return;
+
+	/* The new scene buffer holds its own lock on the client's buffer */
+	copy = wlr_scene_buffer_create(snapshot, buffer->buffer);
+	wlr_scene_node_set_position(&copy->node, sx, sy);
+	wlr_scene_buffer_set_dest_size(copy, buffer->dst_width, buffer->dst_height);
+	wlr_scene_buffer_set_source_box(copy, &buffer->src_box);
+	wlr_scene_buffer_set_transform(copy, buffer->transform);
+	wlr_scene_buffer_set_opacity(copy, buffer->opacity);
+}
+
+int
+solidborder(Client *c)
+{
+	struct wlr_surface *surface = client_surface(c);
+	const struct wlr_alpha_modifier_surface_v1_state *alpha
+			= wlr_alpha_modifier_v1_get_surface_state(surface);
+
+	/* Nothing shows through a surface that is opaque and fills the space
+	 * inside the border */
+	return (!alpha || alpha->multiplier >= 1.0)
+			&& surface->current.width >= c->geom.width - 2 * (int)c->bw
+			&& surface->current.height >= c->geom.height - 2 * (int)c->bw
+			&& pixman_region32_contains_rectangle(&surface->opaque_region,
+				&(pixman_box32_t){0, 0, surface->current.width,
+				surface->current.height}) == PIXMAN_REGION_IN;
+}
+
 void
 spawn(const Arg *arg)
 {
@@ -3477,11 +5287,62 @@ spawn(const Arg *arg)
 		close(STDIN_FILENO);
 		dup2(STDERR_FILENO, STDOUT_FILENO);
 		setsid();
+		cgroupenter();
 		execvp(((char **)arg->v)[0], (char **)arg->v);
 		die("dwl: execvp %s failed:", ((char **)arg->v)[0]);
 	}
 }
 
+void
+stallbegin(Client *c)
+{
+	const char *appid = client_get_appid(c);
+
+	/* Stop waiting for it, the layout is committed without its new frame */
+	c->isslow = 1;
+	updatepending(c);
+	stall_count++;
+	wlr_log(WLR_INFO, "%s missed its configure deadline", appid ? appid : broken);
+}
+
+void
+stallend(Client *c)
+{
+	const char *appid = client_get_appid(c);
+	int64_t duration = monotonicmsec() - c->resize_sent;
+	StallStats *st = NULL;
+	size_t i;
+
+	c->isslow = 0;
+	updatepending(c);
+	if (!appid)
+		appid = broken;
+	wlr_log(WLR_INFO, "%s stalled for %lld ms", appid, (long long)duration);
+
+	/* Account it to the app_id, evicting the least stalled entry if needed */
+	for (i = 0; i < LENGTH(stall_worst) && !st; i++) {
+		if (!strncmp(stall_worst[i].appid, appid, sizeof(stall_worst[i].appid) - 1))
+			st = &stall_worst[i];
+	}
+	if (!st) {
+		st = &stall_worst[LENGTH(stall_worst) - 1];
+		if (st->stalls && st->worst > duration)
+			return;
+		memset(st, 0, sizeof(*st));
+		strncpy(st->appid, appid, sizeof(st->appid) - 1);
+	}
+	st->stalls++;
+	st->total += duration;
+	st->worst = MAX(st->worst, duration);
+
+	/* Keep the table sorted by worst stall */
+	for (; st > stall_worst && st->worst > st[-1].worst; st--) {
+		StallStats tmp = st[-1];
+		st[-1] = *st;
+		*st = tmp;
+	}
+}
+
 void
 startdrag(struct wl_listener *listener, void *data)
 {
@@ -3531,6 +5392,15 @@ tag(const Arg *arg)
 	drawbars();
 }
 
+unsigned int
+tagindex(uint32_t mask)
+{
+	/* Clients with a single tag live in its subtree, which is enabled while
+	 * the tag is viewed; the ones with several tags share the last subtree,
+	 * which stays enabled, and are shown or hidden one by one. */
+	return mask && !(mask & (mask - 1)) ? (unsigned int)__builtin_ctz(mask) : TAGCOUNT;
+}
+
 void
 tagmon(const Arg *arg)
 {
@@ -3713,11 +5583,81 @@ unmapnotify(struct wl_listener *listener, void *data)
 	}
 
 	wlr_scene_node_destroy(&c->scene->node);
+	c->snapshot = NULL;
+	occlusion_dirty = 1;
+	if (c->isslow)
+		stallend(c);
   printstatus();
 	drawbars();
 	motionnotify(0, NULL, 0, 0, 0, 0);
 }
 
+void
+updatebar(Monitor *m)
+{
+	size_t i;
+	int rw, rh;
+	char fontattrs[12];
+
+	wlr_output_transformed_resolution(m->wlr_output, &rw, &rh);
+	m->b.width = rw;
+	m->b.real_width = (int)((float)m->b.width / m->wlr_output->scale);
+
+	wlr_scene_node_set_enabled(&m->scene_buffer->node, m->wlr_output->enabled ? showbar : 0);
+
+	for (i = 0; i < LENGTH(m->pool); i++)
+		if (m->pool[i]) {
+			wlr_buffer_drop(&m->pool[i]->base);
+			m->pool[i] = NULL;
+		}
+
+	if (m->b.scale == m->wlr_output->scale && m->drw)
+		return;
+
+	drwl_font_destroy(m->drw->font);
+	snprintf(fontattrs, sizeof(fontattrs), "dpi=%.2f", 96. * m->wlr_output->scale);
+	if (!(drwl_font_create(m->drw, LENGTH(fonts), fonts, fontattrs)))
+		die("Could not load font");
+
+	m->b.scale = m->wlr_output->scale;
+	m->lrpad = m->drw->font->height;
+	m->b.height = m->drw->font->height + 2;
+	m->b.real_height = (int)((float)m->b.height / m->wlr_output->scale);
+}
+
+void
+updateborder(Client *c)
+{
+	int i, solid = solidborder(c);
+
+	/* A single rect behind an opaque surface makes the whole border,
+	 * otherwise each side gets its own */
+	if (solid != c->solidborder) {
+		c->solidborder = solid;
+		for (i = 1; i < 4; i++) {
+			if (!c->border[i]) {
+				c->border[i] = wlr_scene_rect_create(c->scene, 0, 0, c->border[0]->color);
+				c->border[i]->node.data = c;
+			}
+			wlr_scene_rect_set_color(c->border[i], c->border[0]->color);
+			wlr_scene_node_set_enabled(&c->border[i]->node, !solid);
+		}
+	}
+
+	if (solid) {
+		wlr_scene_node_set_position(&c->border[0]->node, 0, 0);
+		wlr_scene_rect_set_size(c->border[0], c->geom.width, c->geom.height);
+		return;
+	}
+	wlr_scene_rect_set_size(c->border[0], c->geom.width, c->bw);
+	wlr_scene_rect_set_size(c->border[1], c->geom.width, c->bw);
+	wlr_scene_rect_set_size(c->border[2], c->bw, c->geom.height - 2 * c->bw);
+	wlr_scene_rect_set_size(c->border[3], c->bw, c->geom.height - 2 * c->bw);
+	wlr_scene_node_set_position(&c->border[1]->node, 0, c->geom.height - c->bw);
+	wlr_scene_node_set_position(&c->border[2]->node, 0, c->bw);
+	wlr_scene_node_set_position(&c->border[3]->node, c->geom.width - c->bw, c->bw);
+}
+
 void
 updatemons(struct wl_listener *listener, void *data)
 {
@@ -3832,36 +5772,56 @@ updatemons(struct wl_listener *listener, void *data)
 }
 
 void
-updatebar(Monitor *m)
+updateocclusion(void)
 {
+	/* Scene layers holding clients, from the top */
+	static const int stack[] = {LyrFS, LyrFloat, LyrTile};
+	pixman_region32_t covered;
+	struct wlr_scene_node *node, *child;
+	Monitor *m;
 	size_t i;
-	int rw, rh;
-	char fontattrs[12];
 
-	wlr_output_transformed_resolution(m->wlr_output, &rw, &rh);
-	m->b.width = rw;
-	m->b.real_width = (int)((float)m->b.width / m->wlr_output->scale);
-
-	wlr_scene_node_set_enabled(&m->scene_buffer->node, m->wlr_output->enabled ? showbar : 0);
-
-	for (i = 0; i < LENGTH(m->pool); i++)
-		if (m->pool[i]) {
-			wlr_buffer_drop(&m->pool[i]->base);
-			m->pool[i] = NULL;
+	/* Walk the clients from the top down, collecting what is opaque in
+	 * layout coordinates; a client that lies entirely within it is
+	 * neither rendered nor sent frame done, and is suspended. */
+	occlusion_dirty = 0;
+	pixman_region32_init(&covered);
+	for (i = 0; i < LENGTH(stack); i++) {
+		wl_list_for_each_reverse(node, &layers[stack[i]]->children, link) {
+			if (node->data) {
+				occludeclient(node->data, &covered);
+			} else if (node->type == WLR_SCENE_NODE_TREE) {
+				/* The clients of a tag, see tagindex() */
+				wl_list_for_each_reverse(child,
+						&wlr_scene_tree_from_node(node)->children, link)
+					occludeclient(child->data, &covered);
+			} else {
+				wl_list_for_each(m, &mons, link) {
+					if (node == &m->fullscreen_bg->node && node->enabled
+							&& fullscreen_bg[3] >= 1.0f)
+						pixman_region32_union_rect(&covered, &covered,
+								m->m.x, m->m.y, m->m.width, m->m.height);
+				}
+			}
 		}
+	}
+	pixman_region32_fini(&covered);
+}
 
-	if (m->b.scale == m->wlr_output->scale && m->drw)
-		return;
-
-	drwl_font_destroy(m->drw->font);
-	snprintf(fontattrs, sizeof(fontattrs), "dpi=%.2f", 96. * m->wlr_output->scale);
-	if (!(drwl_font_create(m->drw, LENGTH(fonts), fonts, fontattrs)))
-		die("Could not load font");
+void
+updatepending(Client *c)
+{
+	Monitor *m = c->resize && !c->isslow && !c->isfloating && c->mon
+			&& (c->outputs & c->mon->bit) && !client_is_stopped(c) ? c->mon : NULL;
 
-	m->b.scale = m->wlr_output->scale;
-	m->lrpad = m->drw->font->height;
-	m->b.height = m->drw->font->height + 2;
-	m->b.real_height = (int)((float)m->b.height / m->wlr_output->scale);
+	/* Move its pending resize to the count of the monitor that waits for it */
+	if (m == c->resizemon)
+		return;
+	if (c->resizemon)
+		c->resizemon->pendingresizes--;
+	if (m)
+		m->pendingresizes++;
+	c->resizemon = m;
 }
 
 void
@@ -3873,6 +5833,68 @@ updatetitle(struct wl_listener *listener, void *data)
 		drawbars();
 }
 
+void
+updatevisibility(Client *c)
+{
+	struct wlr_box box;
+	uint32_t outputs = 0;
+	int visibility;
+	Monitor *m;
+
+	/* Derived from what arrange() and updateocclusion() already know, the
+	 * subscribers of visibility_signal only hear about actual changes. */
+	if (!c->mon || !VISIBLEON(c, c->mon))
+		visibility = VisHidden;
+	else if (c->occluded || c->covered)
+		visibility = VisOccluded;
+	else
+		visibility = c->overlapped ? VisPartial : VisVisible;
+
+	if (visibility >= VisPartial) {
+		wl_list_for_each(m, &mons, link) {
+			if (m->wlr_output->enabled && wlr_box_intersection(&box, &c->geom, &m->m))
+				outputs |= m->bit;
+		}
+	}
+
+	if (visibility == c->visibility && outputs == c->outputs)
+		return;
+	c->visibility = visibility;
+	c->outputs = outputs;
+	wl_signal_emit(&visibility_signal, c);
+}
+
+void
+updateweights(void)
+{
+	Client *c, *w, *focused;
+	unsigned int weight;
+
+	if (!cgroup_path[0])
+		return;
+
+	/* A scope is weighted by its most important window */
+	focused = focustop(selmon);
+	wl_list_for_each(c, &clients, link) {
+		if (!c->scope)
+			continue;
+		weight = cgroup_weight_hidden;
+		wl_list_for_each(w, &clients, link) {
+			if (w->scope != c->scope || !w->mon || !VISIBLEON(w, w->mon))
+				continue;
+			weight = MAX(weight, w == focused ? cgroup_weight_focused : cgroup_weight_visible);
+		}
+		if (weight == c->cgweight)
+			continue;
+		cgroupwrite(c->scope, "cpu.weight", "%u", weight);
+		cgroupwrite(c->scope, "io.weight", "default %u", weight);
+		wl_list_for_each(w, &clients, link) {
+			if (w->scope == c->scope)
+				w->cgweight = weight;
+		}
+	}
+}
+
 void
 urgent(struct wl_listener *listener, void *data)
 {
@@ -3963,22 +5985,47 @@ void
 xytonode(double x, double y, struct wlr_surface **psurface,
 		Client **pc, LayerSurface **pl, double *nx, double *ny)
 {
-	struct wlr_scene_node *node, *pnode;
+	struct wlr_scene_node *node, *pnode, *hit = NULL;
 	struct wlr_surface *surface = NULL;
 	struct wlr_scene_surface *scene_surface = NULL;
 	Client *c = NULL;
 	LayerSurface *l = NULL;
-	int layer;
+	int layer, hitlayer = 0, lx, ly;
+	double sx = 0, sy = 0;
+
+	/* Motion within the box of the last hit keeps hitting it, as long as
+	 * the node itself was neither moved nor disabled */
+	if (hitcache.node && wlr_box_contains_point(&hitcache.box, x, y)
+			&& wlr_scene_node_coords(hitcache.node, &lx, &ly)
+			&& lx == hitcache.lx && ly == hitcache.ly) {
+		if (psurface) *psurface = hitcache.surface;
+		if (pc) *pc = hitcache.c;
+		if (pl) *pl = hitcache.l;
+		if (nx) *nx = x - hitcache.x;
+		if (ny) *ny = y - hitcache.y;
+		return;
+	}
 
 	for (layer = NUM_LAYERS - 1; !surface && layer >= 0; layer--) {
-		if (!(node = wlr_scene_node_at(&layers[layer]->node, x, y, nx, ny)))
+		if (!(node = wlr_scene_node_at(&layers[layer]->node, x, y, &sx, &sy)))
 			continue;
 
 		if (node->type == WLR_SCENE_NODE_BUFFER) {
 			scene_surface = wlr_scene_surface_try_from_buffer(
 					wlr_scene_buffer_from_node(node));
-			if (!scene_surface) continue;
-			surface = scene_surface->surface;
+			if (scene_surface) {
+				surface = scene_surface->surface;
+				hit = node;
+				hitlayer = layer;
+			} else if ((c = node->parent->node.data)) {
+				/* A snapshot standing in for its client, see joinlayout().
+				 * The client is still where the snapshot is shown. */
+				surface = client_surface(c);
+				sx = x - c->scene->node.x - c->bw;
+				sy = y - c->scene->node.y - c->bw;
+			} else {
+				continue;
+			}
 		}
 		/* Walk the tree to find a node that knows the client */
 		for (pnode = node; pnode && !c; pnode = &pnode->parent->node)
@@ -3989,9 +6036,19 @@ xytonode(double x, double y, struct wlr_surface **psurface,
 		}
 	}
 
+	invalidatehit();
+	if (hit) {
+		cachehit(hit, hitlayer, x, y, sx, sy);
+		hitcache.surface = surface;
+		hitcache.c = c;
+		hitcache.l = l;
+	}
+
 	if (psurface) *psurface = surface;
 	if (pc) *pc = c;
 	if (pl) *pl = l;
+	if (nx) *nx = sx;
+	if (ny) *ny = sy;
 }
 
 void